@@ -0,0 +1,135 @@
+#include "BatchSearch.h"
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TREE_HAVE_AVX2_KERNEL 1
+#endif
+
+namespace
+{
+    const std::size_t lanes = 8;
+
+    bool before(int a, int b) { return a < b; }
+    // NaN after every number, as DoubleType::compare has it
+    bool before(double a, double b) { return a < b || (b != b && a == a); }
+
+    // each key of a group descends its own path; keys that already hit a
+    // value or fell off the array stay put until the whole group is done
+    template <class T>
+    void scalarBatch(const T *e, std::size_t n, const T *keys, std::size_t m, bool *out)
+    {
+        for (std::size_t i = 0; i < m; i += lanes)
+        {
+            std::size_t g = m - i < lanes ? m - i : lanes;
+            std::size_t k[lanes] = {};
+            bool found[lanes] = {};
+            for (bool live = true; live;)
+            {
+                live = false;
+                for (std::size_t j = 0; j < g; ++j)
+                {
+                    if (found[j] || k[j] >= n)
+                        continue;
+                    T key = keys[i + j], v = e[k[j]];
+                    bool lt = before(key, v), gt = before(v, key);
+                    found[j] = !lt && !gt;
+                    k[j] = 2 * k[j] + 1 + gt;
+                    live = true;
+                }
+            }
+            for (std::size_t j = 0; j < g; ++j)
+                out[i + j] = found[j];
+        }
+    }
+
+#ifdef TREE_HAVE_AVX2_KERNEL
+    bool hasAvx2()
+    {
+        static const bool ok = __builtin_cpu_supports("avx2");
+        return ok;
+    }
+
+    __attribute__((target("avx2"))) std::size_t avx2Batch(const int *e, std::size_t n, const int *keys, std::size_t m, bool *out)
+    {
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i nv = _mm256_set1_epi32(static_cast<int>(n));
+        std::size_t i = 0;
+        for (; i + 8 <= m; i += 8)
+        {
+            __m256i key = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+            __m256i k = _mm256_setzero_si256();
+            __m256i found = _mm256_setzero_si256();
+            for (;;)
+            {
+                __m256i live = _mm256_andnot_si256(found, _mm256_cmpgt_epi32(nv, k));
+                if (_mm256_testz_si256(live, live))
+                    break;
+                __m256i v = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), e, k, live, 4);
+                __m256i gt = _mm256_cmpgt_epi32(key, v);
+                found = _mm256_or_si256(found, _mm256_and_si256(live, _mm256_cmpeq_epi32(key, v)));
+                // gt lanes are -1, so 2k + 1 - gt picks the right child
+                __m256i next = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(k, k), one), gt);
+                k = _mm256_blendv_epi8(k, next, live);
+            }
+            int mask = _mm256_movemask_ps(_mm256_castsi256_ps(found));
+            for (int j = 0; j < 8; ++j)
+                out[i + j] = (mask >> j) & 1;
+        }
+        return i;
+    }
+
+    __attribute__((target("avx2"))) std::size_t avx2Batch(const double *e, std::size_t n, const double *keys, std::size_t m, bool *out)
+    {
+        const __m256i one = _mm256_set1_epi64x(1);
+        const __m256i nv = _mm256_set1_epi64x(static_cast<long long>(n));
+        std::size_t i = 0;
+        for (; i + 4 <= m; i += 4)
+        {
+            __m256d key = _mm256_loadu_pd(keys + i);
+            __m256i k = _mm256_setzero_si256();
+            __m256i found = _mm256_setzero_si256();
+            for (;;)
+            {
+                __m256i live = _mm256_andnot_si256(found, _mm256_cmpgt_epi64(nv, k));
+                if (_mm256_testz_si256(live, live))
+                    break;
+                __m256d v = _mm256_mask_i64gather_pd(_mm256_setzero_pd(), e, k, _mm256_castsi256_pd(live), 8);
+                __m256d knan = _mm256_cmp_pd(key, key, _CMP_UNORD_Q), vnan = _mm256_cmp_pd(v, v, _CMP_UNORD_Q);
+                __m256i lt = _mm256_castpd_si256(_mm256_or_pd(_mm256_cmp_pd(key, v, _CMP_LT_OQ), _mm256_andnot_pd(knan, vnan)));
+                __m256i gt = _mm256_castpd_si256(_mm256_or_pd(_mm256_cmp_pd(key, v, _CMP_GT_OQ), _mm256_andnot_pd(vnan, knan)));
+                __m256i eq = _mm256_andnot_si256(_mm256_or_si256(lt, gt), live);
+                found = _mm256_or_si256(found, eq);
+                __m256i next = _mm256_sub_epi64(_mm256_add_epi64(_mm256_add_epi64(k, k), one), gt);
+                k = _mm256_blendv_epi8(k, next, live);
+            }
+            int mask = _mm256_movemask_pd(_mm256_castsi256_pd(found));
+            for (int j = 0; j < 4; ++j)
+                out[i + j] = (mask >> j) & 1;
+        }
+        return i;
+    }
+#endif
+
+    template <class T>
+    void batch(const T *e, std::size_t n, const T *keys, std::size_t m, bool *out)
+    {
+        std::size_t done = 0;
+#ifdef TREE_HAVE_AVX2_KERNEL
+        // 32-bit lane indices reach 2n + 2 before a lane retires
+        if (hasAvx2() && n < (std::size_t(1) << 30))
+            done = avx2Batch(e, n, keys, m, out);
+#endif
+        scalarBatch(e, n, keys + done, m - done, out + done);
+    }
+}
+
+void eytzingerSearchBatch(const int *eytz, std::size_t n, const int *keys, std::size_t m, bool *out)
+{
+    batch(eytz, n, keys, m, out);
+}
+
+void eytzingerSearchBatch(const double *eytz, std::size_t n, const double *keys, std::size_t m, bool *out)
+{
+    batch(eytz, n, keys, m, out);
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <cstddef>
+
+// Membership test of m keys against an Eytzinger-ordered array of n values:
+// out[i] is true when keys[i] is present. Uses an AVX2 gather kernel when the
+// CPU has it, otherwise a branchless scalar kernel that walks several keys in
+// lockstep. Order and equality follow IntType/DoubleType::compare, NaN included.
+void eytzingerSearchBatch(const int *eytz, std::size_t n, const int *keys, std::size_t m, bool *out);
+void eytzingerSearchBatch(const double *eytz, std::size_t n, const double *keys, std::size_t m, bool *out);
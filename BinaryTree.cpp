@@ -1,61 +1,377 @@
 #include "BinaryTree.h"
+#include "BatchSearch.h"
+#include "Epoch.h"
+#include "ThreadPool.h"
 #include <algorithm>
 #include <stdexcept>
 #include <cmath>
-int BinaryTree::height(Node *nd) const
+#include <cstring>
+BinaryTree::BinaryTree(Type *t, BalancePolicy p, Concurrency c)
+    : type(t), root(nullptr), count(0), pol(p), hits(0),
+      inlineValues(t->trivial() && t->size() <= inlineCap), keyWords(t->keyWords()),
+      exactKeys(keyWords && t->exactKey()), sized(false),
+      store(std::make_shared<Storage>(sizeof(Node) + keyWords * 8 + (inlineValues ? (t->size() + 7) / 8 * 8 : 0),
+                                      SlabPool::sizeClass(t->size()))),
+      frozen(false), eytzStride(0),
+      conc(c), published(nullptr), txn(0), scopeDepth(0), forking(false) {}
+BinaryTree::~BinaryTree() { clear(); }
+
+BinaryTree::WriteScope::WriteScope(BinaryTree &tree) : t(tree)
 {
-    if (!nd)
-        return 0;
-    return 1 + std::max(height(nd->left), height(nd->right));
+    if (t.conc == Concurrency::None)
+        return;
+    t.writer.lock();
+    if (t.scopeDepth++ == 0 && ++t.txn == 0)
+        t.restamp();
+}
+BinaryTree::WriteScope::~WriteScope()
+{
+    if (t.conc == Concurrency::None)
+        return;
+    if (--t.scopeDepth == 0)
+        t.publish();
+    t.writer.unlock();
+}
+// txn wrapped around: a node stamped 2^32 writes ago would now pass for one
+// of this write's own. Every live node is stamped 0, which txn never is again.
+void BinaryTree::restamp()
+{
+    preorderWalk(root, [](Node *n)
+                 { n->stamp = 0; });
+    txn = 1;
+}
+std::unique_lock<std::recursive_mutex> BinaryTree::serialize() const
+{
+    if (conc == Concurrency::None)
+        return std::unique_lock<std::recursive_mutex>();
+    return std::unique_lock<std::recursive_mutex>(writer);
+}
+void BinaryTree::publish()
+{
+    published.store(root);
+    if (retiredNow.empty())
+        return;
+    // readers that start after advance() can only reach the new root
+    std::uint64_t r = Epoch::advance();
+    for (Node *n : retiredNow)
+        limbo.emplace_back(n, r);
+    retiredNow.clear();
+    if (limbo.size() >= reclaimBatch)
+        reclaim();
+}
+void BinaryTree::reclaim()
+{
+    std::uint64_t oldest = Epoch::oldestActive();
+    size_t w = 0;
+    for (auto &e : limbo)
+    {
+        if (e.second < oldest)
+            freeNode(e.first);
+        else
+            limbo[w++] = e;
+    }
+    limbo.resize(w);
+}
+BinaryTree::Node *BinaryTree::own(Node *nd)
+{
+    if (!shared(nd))
+        return nd;
+    // a frozen array may point at nd's value, which is no longer ours to keep
+    if (frozen && !inlineValues)
+        thaw();
+    Node *c = rawNode();
+    copyValue(c->data, nd->data);
+    std::copy_n(keyOf(nd), keyWords, keyOf(c));
+    c->left = nd->left;
+    c->right = nd->right;
+    c->size = nd->size;
+    c->hash = nd->hash;
+    c->height = nd->height;
+    if (nd->refs > 1)
+    {
+        // the copy links the same children; the caller drops its link to nd
+        for (Node *ch : {nd->left, nd->right})
+            if (ch)
+                ++ch->refs;
+        --nd->refs;
+    }
+    else
+        retire(nd);
+    return c;
+}
+// nd is unlinked and its children are linked elsewhere by the caller
+void BinaryTree::release(Node *nd)
+{
+    if (nd->refs > 1)
+    {
+        for (Node *ch : {nd->left, nd->right})
+            if (ch)
+                ++ch->refs;
+        --nd->refs;
+    }
+    else if (shared(nd))
+        retire(nd);
+    else
+        freeNode(nd);
+}
+void BinaryTree::retire(Node *nd)
+{
+    auto lk = poolLock();
+    retiredNow.push_back(nd);
+}
+std::unique_lock<std::mutex> BinaryTree::poolLock()
+{
+    if (!forking)
+        return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(poolMutex);
+}
+// dst is owned; src is about to be released
+void BinaryTree::takeValue(Node *dst, Node *src)
+{
+    if (inlineValues)
+        std::memcpy(dst->data, src->data, type->size());
+    else if (shared(src))
+    {
+        destructValue(dst->data);
+        copyValue(dst->data, src->data);
+    }
+    else
+        std::swap(dst->data, src->data);
+    std::copy_n(keyOf(src), keyWords, keyOf(dst));
 }
-
-BinaryTree::BinaryTree(Type *t) : type(t), root(nullptr), count(0) {}
-BinaryTree::~BinaryTree() { clear(); }
 
 void BinaryTree::clear()
 {
-    destroyRec(root);
+    WriteScope ws(*this);
+    thaw();
+    if (conc != Concurrency::None)
+    {
+        // wait out the readers instead of retiring node by node
+        published.store(nullptr);
+        Epoch::synchronize();
+        for (auto &e : limbo)
+            retiredNow.push_back(e.first);
+        limbo.clear();
+        if (!type->trivial())
+            for (Node *n : retiredNow)
+                destructValue(n->data);
+        counters.add(TreeStats::NodeFrees, retiredNow.size());
+        retiredNow.clear();
+    }
+    if (sharing())
+    {
+        // other trees may link our nodes and own nodes in the same slabs
+        Core::dropRef(*this, root);
+        store = std::make_shared<Storage>(store->nodes.blockSize(), store->values.blockSize());
+        root = nullptr;
+        count = 0;
+        return;
+    }
+    // trivially destructible values need no walk: the slabs go back whole
+    if (!type->trivial())
+        destroyAll(root);
+    counters.add(TreeStats::NodeFrees, count);
+    store->nodes.release();
+    store->values.release();
     root = nullptr;
     count = 0;
 }
-void BinaryTree::destroyRec(Node *nd)
+void BinaryTree::destroyAll(Node *nd)
 {
-    if (!nd)
-        return;
-    destroyRec(nd->left);
-    destroyRec(nd->right);
-    type->destroy(nd->data);
-    delete nd;
+    std::vector<Node *> st;
+    if (nd)
+        st.push_back(nd);
+    while (!st.empty())
+    {
+        Node *n = st.back();
+        st.pop_back();
+        if (n->left)
+            st.push_back(n->left);
+        if (n->right)
+            st.push_back(n->right);
+        destructValue(n->data);
+    }
+}
+
+// value storage and the key words are left unconstructed
+BinaryTree::Node *BinaryTree::rawNode()
+{
+    auto lk = poolLock();
+    char *mem = static_cast<char *>(store->nodes.alloc());
+    char *value = mem + sizeof(Node) + keyWords * 8;
+    Node *nd = new (mem) Node(inlineValues ? value : store->values.alloc());
+    nd->stamp = txn;
+    counters.add(TreeStats::NodeAllocs);
+    return nd;
+}
+BinaryTree::Node *BinaryTree::newNode(void *d)
+{
+    Node *nd = rawNode();
+    copyValue(nd->data, d);
+    cacheKey(nd);
+    return nd;
+}
+void BinaryTree::freeNode(Node *nd)
+{
+    destructValue(nd->data);
+    counters.add(TreeStats::NodeFrees);
+    auto lk = poolLock();
+    if (!inlineValues)
+        store->values.free(nd->data);
+    store->nodes.free(nd);
 }
 
 bool BinaryTree::insertRaw(void *d)
 {
-    void *v = type->clone(d);
-    bool ok = insertRec(root, v);
-    if (!ok)
-        type->destroy(v);
+    TreeStats::Timer tm(counters, TreeStats::Insert);
+    WriteScope ws(*this);
+    Probe k = probe(d);
+    if (sharing())
+        Core::unsharePath(*this, k);
+    bool ok = Core::insert(*this, k, [&]
+                           { return newNode(d); });
+    if (ok)
+        thaw();
     return ok;
 }
-bool BinaryTree::insertRec(Node *&nd, void *d)
+bool BinaryTree::insertOwned(void *d)
+{
+    bool ok = insertMoved(d);
+    type->destroy(d);
+    return ok;
+}
+bool BinaryTree::emplaceFromString(std::string_view s)
+{
+    ParsedValue v(*type, s);
+    return insertMoved(v.get());
+}
+// Builds the node by moving from src, which stays destroyable, and links it;
+// a duplicate goes straight back to the pool.
+bool BinaryTree::insertMoved(void *src)
 {
-    if (!nd)
+    TreeStats::Timer tm(counters, TreeStats::Insert);
+    WriteScope ws(*this);
+    Node *nd = rawNode();
+    type->moveTo(nd->data, src);
+    counters.add(TreeStats::Clones);
+    cacheKey(nd);
+    Probe k = probe(nd);
+    if (sharing())
+        Core::unsharePath(*this, k);
+    if (!Core::insert(*this, k, [nd]
+                      { return nd; }))
     {
-        nd = new Node(d);
-        count++;
-        return true;
-    }
-    int cmp = type->compare(d, nd->data);
-    if (cmp == 0)
+        freeNode(nd);
         return false;
-    return cmp < 0 ? insertRec(nd->left, d) : insertRec(nd->right, d);
+    }
+    thaw();
+    return true;
+}
+// Splay climbs from where the new node goes, the rest relink the path
+void BinaryTree::link(PathStack<Node> &path, Node *nd)
+{
+    if (splaying())
+        semiSplay(path, nd);
+    else
+        root = Core::relinkPath(*this, path, nd);
 }
 
 bool BinaryTree::searchRaw(void *key) const
 {
-    Node *cur = root;
+    TreeStats::Timer tm(counters, TreeStats::Search);
+    if (conc != Concurrency::None)
+    {
+        Epoch::Guard g;
+        return searchFrom(published.load(), key);
+    }
+    if (frozen)
+        return searchFrozen(key);
+    return searchFrom(root, key);
+}
+bool BinaryTree::accessRaw(void *key)
+{
+    if (frozen || !splaying())
+        return searchRaw(key);
+    TreeStats::Timer tm(counters, TreeStats::Search);
+    return splaySearch(key);
+}
+// A miss leaves the tree as it was, and so do most hits: only every
+// splayEvery-th one is splayed, which keeps the hot values near the root at
+// a quarter of the rotations. A hit deeper than 2 log2(n) always is, so a
+// degenerate path pays for its own repair as under plain splaying.
+bool BinaryTree::splaySearch(void *key)
+{
+    Probe k = probe(key);
+    PathStack<Node> path;
+    size_t depth = 0;
+    for (Node *nd = root; nd; ++depth)
+    {
+        int cmp = compare(k, nd);
+        if (cmp == 0)
+        {
+            bool deep = depth / 2 >= 64 || (size_t(1) << depth / 2) > count;
+            if (deep || ++hits % splayEvery == 0)
+                semiSplay(path, nd);
+            return true;
+        }
+        path.push(nd, cmp < 0);
+        nd = (cmp < 0 ? nd->left : nd->right);
+    }
+    return false;
+}
+// Rotates nd's left (or right) child above it. Heights mean nothing outside
+// AVL, so unlike rotateLeft/rotateRight this reads no children off the path
+// unless sizes are kept.
+BinaryTree::Node *BinaryTree::lift(Node *nd, bool left)
+{
+    Node *c = left ? nd->left : nd->right;
+    if (left)
+    {
+        nd->left = c->right;
+        c->right = nd;
+    }
+    else
+    {
+        nd->right = c->left;
+        c->left = nd;
+    }
+    nd->hash = c->hash = 0;
+    if (sized)
+    {
+        nd->size = static_cast<unsigned>(1 + Core::sizeOf(nd->left) + Core::sizeOf(nd->right));
+        c->size = static_cast<unsigned>(1 + Core::sizeOf(c->left) + Core::sizeOf(c->right));
+    }
+    return c;
+}
+// Links x where the path ends and climbs two levels per step. Zig-zig
+// rotates only the grandparent, so the parent takes its place and the climb
+// goes on from there: x ends up about half as deep instead of at the root,
+// for half the rotations. Every node on the path is rotated, so sizes and
+// hashes come out fresh.
+void BinaryTree::semiSplay(PathStack<Node> &path, Node *x)
+{
+    while (!path.empty())
+    {
+        auto p = path.pop();
+        (p.left ? p.node->left : p.node->right) = x;
+        if (path.empty())
+        {
+            x = lift(p.node, p.left);
+            break;
+        }
+        auto g = path.pop();
+        if (p.left != g.left)
+            (g.left ? g.node->left : g.node->right) = lift(p.node, p.left);
+        x = lift(g.node, g.left);
+    }
+    root = x;
+}
+bool BinaryTree::searchFrom(Node *cur, void *key) const
+{
+    Probe k = probe(key);
     while (cur)
     {
-        int cmp = type->compare(key, cur->data);
+        int cmp = compare(k, cur);
         if (cmp == 0)
             return true;
         cur = (cmp < 0 ? cur->left : cur->right);
@@ -65,91 +381,145 @@ bool BinaryTree::searchRaw(void *key) const
 
 bool BinaryTree::removeRaw(void *key)
 {
-    bool rem = false;
-    root = removeRec(root, key, rem);
+    TreeStats::Timer tm(counters, TreeStats::Remove);
+    WriteScope ws(*this);
+    Probe k = probe(key);
+    if (sharing())
+        Core::unsharePath(*this, k);
+    bool rem = Core::remove(*this, k);
     if (rem)
-        --count;
+        thaw();
     return rem;
 }
-BinaryTree::Node *BinaryTree::removeRec(Node *nd, void *key, bool &rem)
+BinaryTree::Iterator BinaryTree::begin() const
 {
-    if (!nd)
-        return nullptr;
-    int cmp = type->compare(key, nd->data);
-    if (cmp < 0)
-        nd->left = removeRec(nd->left, key, rem);
-    else if (cmp > 0)
-        nd->right = removeRec(nd->right, key, rem);
-    else
+    Iterator it(this);
+    inorderDescend(it.path, root, &Node::left);
+    return it;
+}
+BinaryTree::Iterator BinaryTree::lowerBound(void *key) const { return bound(key, false); }
+BinaryTree::Iterator BinaryTree::upperBound(void *key) const { return bound(key, true); }
+BinaryTree::Iterator BinaryTree::bound(void *key, bool upper) const
+{
+    Iterator it(this);
+    it.path = Core::boundPath(*this, probe(key), upper);
+    return it;
+}
+
+void BinaryTree::enableOrderStatistics()
+{
+    WriteScope ws(*this);
+    Core::enableOrderStatistics(*this);
+}
+size_t BinaryTree::rank(void *key) const
+{
+    auto lk = serialize();
+    return Core::countBelow(*this, probe(key), false);
+}
+void *BinaryTree::select(size_t k) const
+{
+    auto lk = serialize();
+    return Core::select(*this, k);
+}
+size_t BinaryTree::countRange(void *lo, void *hi) const
+{
+    auto lk = serialize();
+    return Core::countRange(*this, probe(lo), probe(hi));
+}
+
+void BinaryTree::freeze()
+{
+    auto lk = serialize();
+    std::vector<void *> sorted;
+    sorted.reserve(count);
+    std::vector<Node *> st;
+    for (Node *cur = root; cur || !st.empty();)
     {
-        rem = true;
-        if (!nd->left && !nd->right)
-        {
-            type->destroy(nd->data);
-            delete nd;
-            return nullptr;
-        }
-        if (!nd->left)
-        {
-            Node *tmp = nd->right;
-            type->destroy(nd->data);
-            delete nd;
-            return tmp;
-        }
-        if (!nd->right)
+        while (cur)
         {
-            Node *tmp = nd->left;
-            type->destroy(nd->data);
-            delete nd;
-            return tmp;
+            st.push_back(cur);
+            cur = cur->left;
         }
-        Node *m = findMin(nd->right);
-        void *copy = type->clone(m->data);
-        type->destroy(nd->data);
-        nd->data = copy;
-        nd->right = removeRec(nd->right, m->data, rem);
+        cur = st.back();
+        st.pop_back();
+        sorted.push_back(cur->data);
+        cur = cur->right;
     }
-    return nd;
+    // inline values are copied into the array, others are referenced
+    eytzStride = inlineValues ? type->size() : sizeof(void *);
+    eytz.assign(sorted.size() * eytzStride, 0);
+    size_t i = 0;
+    eytzingerInorder(sorted.size(), [&](size_t k)
+                     {
+        std::memcpy(&eytz[k * eytzStride], inlineValues ? sorted[i] : &sorted[i], eytzStride);
+        ++i; });
+    frozen = true;
 }
-BinaryTree::Node *BinaryTree::findMin(Node *nd) const
+void BinaryTree::thaw()
 {
-    while (nd && nd->left)
-        nd = nd->left;
-    return nd;
+    frozen = false;
+    std::vector<char>().swap(eytz);
+}
+void *BinaryTree::frozenSlot(size_t k) const
+{
+    const char *p = eytz.data() + k * eytzStride;
+    return inlineValues ? const_cast<char *>(p) : *reinterpret_cast<void *const *>(p);
+}
+bool BinaryTree::searchFrozen(void *key) const
+{
+    size_t k = 0;
+    while (k < count)
+    {
+#if defined(__GNUC__)
+        // the 16 descendants four levels down are adjacent in the array
+        __builtin_prefetch(eytz.data() + std::min(16 * k + 15, count - 1) * eytzStride);
+#endif
+        int cmp = compare(key, frozenSlot(k));
+        if (cmp == 0)
+            return true;
+        k = 2 * k + 1 + (cmp > 0);
+    }
+    return false;
+}
+void BinaryTree::searchBatch(const void *keys, size_t n, bool *out) const
+{
+    auto lk = serialize();
+    if (frozen && dynamic_cast<IntType *>(type))
+        return eytzingerSearchBatch(reinterpret_cast<const int *>(eytz.data()), count, static_cast<const int *>(keys), n, out);
+    if (frozen && dynamic_cast<DoubleType *>(type))
+        return eytzingerSearchBatch(reinterpret_cast<const double *>(eytz.data()), count, static_cast<const double *>(keys), n, out);
+    const char *k = static_cast<const char *>(keys);
+    for (size_t i = 0; i < n; ++i)
+        out[i] = searchRaw(const_cast<char *>(k + i * type->size()));
 }
-
 std::string BinaryTree::toStringInorder() const
 {
+    auto lk = serialize();
     std::ostringstream os;
-    inorderRec(root, os);
+    if (frozen)
+        eytzingerInorder(count, [&](size_t k)
+                         {
+            type->print(frozenSlot(k), os);
+            os << ' '; });
+    else
+        inorderWalk(root, [&](Node *n)
+                    {
+            type->print(n->data, os);
+            os << ' '; });
     std::string s = os.str();
     if (!s.empty())
         s.pop_back();
     return s;
 }
-void BinaryTree::inorderRec(Node *nd, std::ostringstream &os) const
-{
-    if (!nd)
-        return;
-    inorderRec(nd->left, os);
-    type->print(nd->data, os);
-    os << ' ';
-    inorderRec(nd->right, os);
-}
 
 std::string BinaryTree::toStringPreorder() const
 {
+    auto lk = serialize();
     std::ostringstream os;
-    std::function<void(Node *)> pre = [&](Node *n)
-    {
-        if (!n)
-            return;
+    preorderWalk(root, [&](Node *n)
+                 {
         type->print(n->data, os);
-        os << ' ';
-        pre(n->left);
-        pre(n->right);
-    };
-    pre(root);
+        os << ' '; });
     std::string s = os.str();
     if (!s.empty())
         s.pop_back();
@@ -158,17 +528,12 @@ std::string BinaryTree::toStringPreorder() const
 
 std::string BinaryTree::toStringPostorder() const
 {
+    auto lk = serialize();
     std::ostringstream os;
-    std::function<void(Node *)> post = [&](Node *n)
-    {
-        if (!n)
-            return;
-        post(n->left);
-        post(n->right);
+    postorderWalk(root, [&](Node *n)
+                  {
         type->print(n->data, os);
-        os << ' ';
-    };
-    post(root);
+        os << ' '; });
     std::string s = os.str();
     if (!s.empty())
         s.pop_back();
@@ -177,276 +542,163 @@ std::string BinaryTree::toStringPostorder() const
 
 std::string BinaryTree::toStringFormatted() const
 {
+    auto lk = serialize();
     std::ostringstream os;
-    std::function<void(Node *)> fmt = [&](Node *n)
-    {
-        if (!n)
-            return;
-        os << '{';
-        type->print(n->data, os);
-        os << '}';
-        os << '(';
-        fmt(n->left);
-        os << ')';
-        os << '[';
-        fmt(n->right);
-        os << ']';
-    };
-    fmt(root);
+    formattedWalk(root, os, [&](Node *n)
+                  { type->print(n->data, os); });
     return os.str();
 }
 
 bool BinaryTree::fromStringTraversal(const std::string &str, const std::string &order)
 {
-    clear();
-    std::istringstream iss(str);
-    std::string tok;
-    while (iss >> tok)
-    {
-        void *e = type->createFromString(tok);
-        insertRaw(e);
-    }
+    WriteScope ws(*this);
+    Core::loadTraversal(*this, str, order);
     return true;
 }
 
 bool BinaryTree::fromFormattedString(const std::string &str)
 {
-    clear();
-    for (size_t i = 0; i < str.size(); ++i)
-    {
-        if (str[i] == '{')
-        {
-            size_t j = str.find('}', i);
-            if (j == std::string::npos)
-                break;
-            std::string tok = str.substr(i + 1, j - (i + 1));
-            void *e = type->createFromString(tok);
-            insertRaw(e);
-            i = j;
-        }
-    }
+    WriteScope ws(*this);
+    Core::loadFormatted(*this, str);
     return true;
 }
 
+BinaryTree::Node *BinaryTree::parsedNode(std::string_view tok)
+{
+    ParsedValue v(*type, tok);
+    Node *nd = rawNode();
+    type->moveTo(nd->data, v.get());
+    cacheKey(nd);
+    counters.add(TreeStats::Clones);
+    return nd;
+}
 std::vector<std::pair<void *, void *>> BinaryTree::toPairList() const
 {
-    std::vector<std::pair<void *, void *>> out;
-    if (!root)
-        return out;
-    std::queue<std::pair<Node *, void *>> q;
-    q.push({root, nullptr});
-    while (!q.empty())
-    {
-        auto [n, parent] = q.front();
-        q.pop();
-        out.emplace_back(n->data, parent);
-        if (n->left)
-            q.push({n->left, n->data});
-        if (n->right)
-            q.push({n->right, n->data});
-    }
-    return out;
+    auto lk = serialize();
+    return Core::pairList(*this);
+}
+void BinaryTree::fromSorted(void *const *values, size_t n)
+{
+    WriteScope ws(*this);
+    Core::loadCopies(*this, values, n, "IN");
+}
+std::vector<void *> BinaryTree::toPreorderList() const
+{
+    auto lk = serialize();
+    return Core::preorderList(*this);
+}
+void BinaryTree::fromPreorder(void *const *values, size_t n)
+{
+    WriteScope ws(*this);
+    Core::loadCopies(*this, values, n, "PRE");
 }
 bool BinaryTree::fromPairList(const std::vector<std::pair<void *, void *>> &list)
 {
-    clear();
-    if (list.empty())
-        return true;
-    void *rootVal = nullptr;
-    for (auto &pr : list)
-        if (pr.second == nullptr)
-        {
-            rootVal = pr.first;
-            break;
-        }
-    if (!rootVal)
-        return false;
-    insertRaw(rootVal);
-    for (auto &pr : list)
-        if (pr.second)
-            insertRaw(pr.first);
-    return true;
+    WriteScope ws(*this);
+    return Core::loadPairs(*this, list, false);
+}
+bool BinaryTree::fromPairListOwned(const std::vector<std::pair<void *, void *>> &list)
+{
+    WriteScope ws(*this);
+    return Core::loadPairs(*this, list, true);
 }
 
+// Relinks the existing nodes: no clones, no compares, no allocations.
+// Same shape as inserting medians: the root of [l, r] is (l + r) / 2.
 void BinaryTree::balance()
 {
-    std::vector<void *> vals;
-    std::function<void(Node *)> collect = [&](Node *nd)
-    {
-        if (!nd)
-            return;
-        collect(nd->left);
-        vals.push_back(type->clone(nd->data));
-        collect(nd->right);
-    };
-    collect(root);
-    clear();
-    std::function<void(int, int)> build = [&](int l, int r)
-    {
-        if (l > r)
-            return;
-        int m = (l + r) / 2;
-        insertRaw(vals[m]);
-        build(l, m - 1);
-        build(m + 1, r);
-    };
-    build(0, (int)vals.size() - 1);
-    for (void *v : vals)
-        type->destroy(v);
+    TreeStats::Timer tm(counters, TreeStats::Balance);
+    WriteScope ws(*this);
+    // readers or other trees may be walking these nodes, so relink private copies
+    if (conc != Concurrency::None || sharing())
+        root = Core::ownAll(*this, root);
+    Node *head = treeToVine(root);
+    root = buildFromVine(head, count, [this](Node *nd)
+                         { Core::refresh(*this, nd); });
 }
 
-BinaryTree *BinaryTree::subtree(void *key) const
+BinaryTree *BinaryTree::clone(bool share) const
 {
-    Node *cur = root;
-    while (cur)
-    {
-        int c = type->compare(key, cur->data);
-        if (c == 0)
-            break;
-        cur = (c < 0 ? cur->left : cur->right);
-    }
-    if (!cur)
-        return nullptr;
-    BinaryTree *out = new BinaryTree(type);
-    std::function<void(Node *)> rec = [&](Node *n)
-    {
-        if (!n)
-            return;
-        out->insertRaw(n->data);
-        rec(n->left);
-        rec(n->right);
-    };
-    rec(cur);
+    auto lk = serialize();
+    if (share && conc == Concurrency::None)
+        return sharedCopy(root, count);
+    BinaryTree *out = new BinaryTree(type, pol, conc);
+    size_t n = 0;
+    out->root = Core::copyStructure(*out, root, n);
+    out->count = n;
+    out->sized = sized;
+    out->published.store(out->root); // lock-free readers start from here
     return out;
 }
-
-bool BinaryTree::containsSubtree(const BinaryTree &sub) const
-{
-    if (!sub.root)
-        return true;
-    std::queue<Node *> q;
-    if (root)
-        q.push(root);
-    while (!q.empty())
-    {
-        Node *n = q.front();
-        q.pop();
-        if (type->compare(n->data, sub.root->data) == 0)
-        {
-            std::function<bool(Node *, Node *)> eq = [&](Node *a, Node *b)
-            {
-                if (!a && !b)
-                    return true;
-                if (!a || !b)
-                    return false;
-                if (type->compare(a->data, b->data) != 0)
-                    return false;
-                return eq(a->left, b->left) && eq(a->right, b->right);
-            };
-            if (eq(n, sub.root))
-                return true;
-        }
-        if (n->left)
-            q.push(n->left);
-        if (n->right)
-            q.push(n->right);
-    }
-    return false;
+BinaryTree *BinaryTree::subtree(void *key, bool share) const
+{
+    auto lk = serialize();
+    return Core::subtree(*this, probe(key), share && conc == Concurrency::None);
+}
+BinaryTree *BinaryTree::sharedCopy(Node *nd, size_t n) const
+{
+    BinaryTree *out = new BinaryTree(type, pol);
+    out->store = store;
+    out->sized = sized;
+    out->root = nd;
+    out->count = n;
+    if (nd)
+        ++nd->refs;
+    return out;
+}
+bool BinaryTree::containsSubtree(const TreeEngine &sub) const
+{
+    std::unique_ptr<BinaryTree> hold;
+    const BinaryTree &s = Core::sameEngine(*this, sub, hold);
+    auto lk = serialize();
+    auto subLk = s.serialize();
+    return Core::containsSubtree(*this, s);
+}
+bool BinaryTree::equals(const BinaryTree &other) const
+{
+    auto lk = serialize();
+    auto otherLk = other.serialize();
+    return Core::equals(*this, other);
 }
 
 void *BinaryTree::searchByPathRaw(const std::string &path) const
 {
-    Node *cur = root;
-    for (char c : path)
-    {
-        if (!cur)
-            return nullptr;
-        if (c == 'L' || c == 'l')
-            cur = cur->left;
-        else if (c == 'R' || c == 'r' || c == 'P' || c == 'p')
-            cur = cur->right;
-    }
-    return cur ? cur->data : nullptr;
+    auto lk = serialize();
+    return Core::nodeAt(*this, path);
 }
-void BinaryTree::merge(const BinaryTree &other)
+void BinaryTree::unionWith(const TreeEngine &other) { setOp(Core::SetOp::Union, other); }
+void BinaryTree::intersectWith(const TreeEngine &other) { setOp(Core::SetOp::Intersect, other); }
+void BinaryTree::differenceWith(const TreeEngine &other) { setOp(Core::SetOp::Difference, other); }
+void BinaryTree::setOp(Core::SetOp op, const TreeEngine &other)
 {
-    std::queue<Node *> q;
-    if (other.root)
-        q.push(other.root);
-    while (!q.empty())
-    {
-        Node *n = q.front();
-        q.pop();
-        insertRaw(n->data);
-        if (n->left)
-            q.push(n->left);
-        if (n->right)
-            q.push(n->right);
-    }
+    std::unique_ptr<BinaryTree> hold;
+    const BinaryTree &o = Core::sameEngine(*this, other, hold);
+    WriteScope ws(*this);
+    auto lk = o.serialize();
+    Core::setOp(*this, op, o);
 }
 
 void BinaryTree::printTree(std::ostream &os) const
 {
-    if (!root)
-    {
-        os << "(empty)\n";
-        return;
-    }
-    os << "\n";
-
-    std::vector<Node *> curr{root}, next;
-    int height = this->height(root);
-    int maxWidth = (1 << height) - 1;
-
-    int level = 0;
-    while (!curr.empty() && level < height)
-    {
-        int nodes = curr.size();
-        int spacing = maxWidth / nodes;
-
-        for (int i = 0; i < nodes; ++i)
-        {
-            os << std::string(spacing / 2, ' ');
-            if (curr[i])
-            {
-                type->print(curr[i]->data, os);
-                next.push_back(curr[i]->left);
-                next.push_back(curr[i]->right);
-            }
-            else
-            {
-                os << " ";
-                next.push_back(nullptr);
-                next.push_back(nullptr);
-            }
-            os << std::string(spacing - spacing / 2, ' ');
-        }
-        os << "\n";
-
-        bool anyChild = false;
-        for (auto n : next)
-            if (n)
-            {
-                anyChild = true;
-                break;
-            }
-        if (!anyChild)
-            break;
-
-        int conSpacing = spacing;
-        for (size_t i = 0; i + 1 < next.size(); i += 2)
-        {
-            os << std::string(conSpacing / 2 - 1, ' ');
-            os << (next[i] ? '/' : ' ');
-            os << std::string(2, ' ');
-            os << (next[i + 1] ? '\\' : ' ');
-            os << std::string(conSpacing - conSpacing / 2 - 1, ' ');
-        }
-        os << "\n";
+    auto lk = serialize();
+    printLevels(root, os, [&](Node *n)
+                { type->print(n->data, os); });
+}
 
-        curr.swap(next);
-        next.clear();
-        ++level;
-    }
-    os << "\n";
+std::vector<size_t> BinaryTree::depthHistogram() const
+{
+    auto lk = serialize();
+    return nodesPerDepth(root);
+}
+size_t BinaryTree::memoryEstimate() const
+{
+    auto lk = serialize();
+    size_t perNode = store->nodes.blockSize() + (inlineValues ? 0 : store->values.blockSize());
+    return count * perNode + eytz.capacity();
+}
+std::string BinaryTree::statsJson() const
+{
+    auto lk = serialize();
+    return counters.json(count, depthHistogram(), memoryEstimate(),
+                         store->nodes.reserved() + store->values.reserved() + eytz.capacity());
 }
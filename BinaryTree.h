@@ -2,59 +2,337 @@
 #include <string>
 #include <sstream>
 #include <vector>
-#include <functional>
-#include <queue>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <iterator>
+#include <memory>
 #include "Types.h"
+#include "TreeEngine.h"
+#include "SlabPool.h"
+#include "TreeStats.h"
+#include "TreeWalk.h"
 
-class BinaryTree
+// LockFreeReads: searchRaw never blocks. Writers serialize on a mutex, copy
+// every node they would modify (path copying) and publish the new root when
+// the operation ends; replaced nodes are freed once no reader can see them.
+// The remaining operations take the writers' mutex.
+enum class Concurrency
+{
+    None,
+    LockFreeReads
+};
+
+class BinaryTree : public TreeEngine
 {
 public:
+    // Values of trivial types up to inlineCap bytes live right after the Node
+    // in the same pool block (data points there); larger or non-trivial values
+    // such as std::string come from the value pool. Types with a cached key
+    // keep it in the words between the Node and an inline value.
     struct Node
     {
         void *data;
         Node *left;
         Node *right;
-        Node(void *d) : data(d), left(nullptr), right(nullptr) {}
+        unsigned size;      // nodes in the subtree, kept once order statistics are on
+        unsigned refs;      // links to the node from parents and tree roots
+        unsigned hash : 24; // Merkle hash of the subtree, 0 while stale
+        unsigned height : 8;
+        unsigned stamp; // write transaction that created the node
+        Node(void *d) : data(d), left(nullptr), right(nullptr), size(1), refs(1), hash(0), height(1), stamp(0) {}
+    };
+
+    // In-order iterator that keeps the path from the root, so ++ and -- are
+    // amortized O(1). --end() is the largest value. Any mutation of the tree
+    // invalidates it, and so does accessRaw under Splay.
+    class Iterator
+    {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = void *;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void *const *;
+        using reference = void *;
+
+        Iterator() : tree(nullptr) {}
+        void *operator*() const { return path.back()->data; }
+        Iterator &operator++()
+        {
+            step(&Node::right, &Node::left);
+            return *this;
+        }
+        Iterator &operator--()
+        {
+            step(&Node::left, &Node::right);
+            return *this;
+        }
+        Iterator operator++(int)
+        {
+            Iterator it = *this;
+            ++*this;
+            return it;
+        }
+        Iterator operator--(int)
+        {
+            Iterator it = *this;
+            --*this;
+            return it;
+        }
+        bool operator==(const Iterator &o) const
+        {
+            return path.empty() ? o.path.empty() : !o.path.empty() && path.back() == o.path.back();
+        }
+        bool operator!=(const Iterator &o) const { return !(*this == o); }
+
+    private:
+        friend class BinaryTree;
+        explicit Iterator(const BinaryTree *t) : tree(t) {}
+        void step(Node *Node::*fwd, Node *Node::*back) { inorderStep(path, tree->root, fwd, back); }
+
+        const BinaryTree *tree;
+        std::vector<Node *> path;
     };
 
-    explicit BinaryTree(Type *t);
+    explicit BinaryTree(Type *t, BalancePolicy p = BalancePolicy::None, Concurrency c = Concurrency::None);
     ~BinaryTree();
 
-    void clear();
-    bool insertRaw(void *d);
-    bool searchRaw(void *key) const;
-    bool removeRaw(void *key);
+    void clear() override;
+    size_t size() const { return count; }
+    bool insertRaw(void *d) override;
+    bool insertOwned(void *d) override;
+    bool emplaceFromString(std::string_view s) override;
+    bool searchRaw(void *key) const override;
+    bool accessRaw(void *key) override;
+    bool removeRaw(void *key) override;
 
-    void balance();
+    void balance() override;
 
-    BinaryTree *subtree(void *key) const;
-    bool containsSubtree(const BinaryTree &sub) const;
+    // Compiles the tree into a contiguous Eytzinger-ordered array that serves
+    // searchRaw and toStringInorder until the next mutation drops it.
+    void freeze() override;
+    bool isFrozen() const { return frozen; }
+    // keys: n contiguous values of Type::size() bytes; INT and DOUBLE trees use
+    // the SIMD kernel over the frozen array, everything else searches one by one
+    void searchBatch(const void *keys, size_t n, bool *out) const override;
 
-    std::string toStringInorder() const;
-    std::string toStringPreorder() const;
-    std::string toStringPostorder() const;
-    std::string toStringFormatted() const;
+    Iterator begin() const;
+    Iterator end() const { return Iterator(this); }
+    Iterator lowerBound(void *key) const; // first value >= key
+    Iterator upperBound(void *key) const; // first value > key
+    // rangeRaw without the std::function call per value
+    template <class F>
+    size_t range(void *lo, void *hi, F f) const
+    {
+        auto lk = serialize();
+        return Core::range(*this, probe(lo), probe(hi), f);
+    }
+    size_t rangeRaw(void *lo, void *hi, const std::function<bool(void *)> &f) const override { return range(lo, hi, f); }
+
+    void enableOrderStatistics() override;
+    bool hasOrderStatistics() const { return sized; }
+    size_t rank(void *key) const override;
+    void *select(size_t k) const override;
+    size_t countRange(void *lo, void *hi) const override;
+
+    // Copies of the whole tree or of the subtree under key, rebuilt node for
+    // node in O(k) without compares. With share the copy links this tree's
+    // nodes instead, in O(1) (O(k) to count them without order statistics);
+    // whichever side changes a shared node first copies it, along with the
+    // path to it. Trees sharing nodes must be used from one thread, and
+    // LockFreeReads trees always copy.
+    BinaryTree *clone(bool share = false) const;
+    BinaryTree *subtree(void *key, bool share = false) const override;
+    // Persistent version: an O(1) read view of the current contents. Inserts
+    // and removes on this tree afterwards copy only their root-to-leaf path
+    // and leave the snapshot as it was; nodes go back to the pool when the
+    // last version linking them is dropped.
+    BinaryTree *snapshot() const override { return clone(true); }
+    // Both compare Merkle subtree hashes first and verify node by node only
+    // on a match. Hashes are computed on demand and go stale along every
+    // mutation path, so repeated queries only rehash what changed.
+    bool containsSubtree(const TreeEngine &sub) const override;
+    bool equals(const BinaryTree &other) const; // same values in the same shape
+
+    std::string toStringInorder() const override;
+    std::string toStringPreorder() const override;
+    std::string toStringPostorder() const override;
+    std::string toStringFormatted() const override;
 
-    bool fromStringTraversal(const std::string &str, const std::string &order);
-    bool fromFormattedString(const std::string &str);
+    bool fromStringTraversal(const std::string &str, const std::string &order) override;
+    bool fromFormattedString(const std::string &str) override;
 
-    std::vector<std::pair<void *, void *>> toPairList() const;
-    bool fromPairList(const std::vector<std::pair<void *, void *>> &list);
+    std::vector<std::pair<void *, void *>> toPairList() const override;
+    bool fromPairList(const std::vector<std::pair<void *, void *>> &list) override;
+    bool fromPairListOwned(const std::vector<std::pair<void *, void *>> &list) override;
+    std::vector<void *> toPreorderList() const override;
+    // Copies of n values in the preorder of some search tree, rebuilt in
+    // exactly that shape in O(n).
+    void fromPreorder(void *const *values, size_t n) override;
+    // Copies of n values; strictly ascending input builds a balanced tree in
+    // O(n), anything else is sorted first and loses its duplicates.
+    void fromSorted(void *const *values, size_t n);
 
-    void *searchByPathRaw(const std::string &path) const;
-    void merge(const BinaryTree &other);
-    void printTree(std::ostream &os = std::cout) const;
+    void *searchByPathRaw(const std::string &path) const override;
+    // Split/join set operations, O(m log(n/m + 1)) on balanced inputs. other
+    // is only read; on equal keys the value already in this tree is kept.
+    // Large inputs fork the two recursive halves onto ThreadPool::instance().
+    void unionWith(const TreeEngine &other) override;
+    void intersectWith(const TreeEngine &other) override;
+    void differenceWith(const TreeEngine &other) override;
+    void merge(const TreeEngine &other) { unionWith(other); }
+    void printTree(std::ostream &os = std::cout) const override;
+
+    BalancePolicy policy() const override { return pol; }
+    Concurrency concurrency() const { return conc; }
+
+    // Instrumentation. The counters only move in TREE_STATS builds; the depth
+    // histogram and the memory figures are computed on demand in O(n).
+    const TreeStats &stats() const { return counters; }
+    void resetStats() override { counters.reset(); }
+    std::vector<size_t> depthHistogram() const override;
+    size_t memoryEstimate() const override; // bytes of the pool blocks in use and the frozen array
+    std::string statsJson() const override;
 
 private:
+    friend struct TreeCore<BinaryTree>;
+    using Core = TreeCore<BinaryTree>;
+
+    // concurrent mode: holds the writers' mutex and publishes on the way out
+    class WriteScope
+    {
+    public:
+        explicit WriteScope(BinaryTree &t);
+        ~WriteScope();
+        WriteScope(const WriteScope &) = delete;
+        WriteScope &operator=(const WriteScope &) = delete;
+
+    private:
+        BinaryTree &t;
+    };
+
     Type *type;
     Node *root;
     size_t count;
+    BalancePolicy pol;
+    unsigned hits; // Splay search hits, every splayEvery-th one restructures
+    static constexpr unsigned splayEvery = 4;
+    static constexpr std::size_t inlineCap = 16;
+    bool inlineValues;
+    int keyWords; // Type::key words cached in every node
+    bool exactKeys;
+    bool sized;
+    // node and value pools, shared by trees that share nodes
+    struct Storage
+    {
+        SlabPool nodes;
+        SlabPool values; // one size class: Type::size() rounded up
+        Storage(std::size_t node, std::size_t value) : nodes(node), values(value) {}
+    };
+    std::shared_ptr<Storage> store;
+    bool frozen;
+    std::vector<char> eytz; // BFS order of the implicit balanced tree
+    size_t eytzStride;
+    Concurrency conc;
+    mutable std::recursive_mutex writer;
+    std::atomic<Node *> published; // root as seen by lock-free readers
+    unsigned txn; // outermost write scope, never 0 once the first one opens
+    unsigned scopeDepth;
+    std::vector<Node *> retiredNow;                      // unlinked by the running write
+    std::vector<std::pair<Node *, std::uint64_t>> limbo; // waiting for readers to leave
+    static constexpr size_t reclaimBatch = 64;
+    std::mutex poolMutex; // pools and retiredNow while a set operation forks
+    bool forking;
+    TreeStats counters;
+
+    // Type calls the counters see
+    int compare(void *a, void *b) const
+    {
+        counters.add(TreeStats::Compares);
+        return type->compare(a, b);
+    }
+    // a value with its ordering key, taken once per descent
+    struct Probe
+    {
+        void *value;
+        std::uint64_t key[Type::maxKeyWords];
+    };
+    static std::uint64_t *keyOf(Node *nd) { return reinterpret_cast<std::uint64_t *>(nd + 1); }
+    static const std::uint64_t *keyOf(const Node *nd) { return reinterpret_cast<const std::uint64_t *>(nd + 1); }
+    Probe probe(void *value) const
+    {
+        Probe k{value, {}};
+        if (keyWords)
+            type->key(value, k.key);
+        return k;
+    }
+    Probe probe(const Node *nd) const
+    {
+        Probe k{nd->data, {}};
+        std::copy_n(keyOf(nd), keyWords, k.key);
+        return k;
+    }
+    void cacheKey(Node *nd) const
+    {
+        if (keyWords)
+            type->key(nd->data, keyOf(nd));
+    }
+    // settles on the cached keys unless they tie on an inexact key
+    int compare(const Probe &k, Node *nd) const
+    {
+        const std::uint64_t *c = keyOf(nd);
+        for (int i = 0; i < keyWords; ++i)
+            if (k.key[i] != c[i])
+                return k.key[i] < c[i] ? -1 : +1;
+        if (exactKeys)
+            return 0;
+        return compare(k.value, nd->data);
+    }
+    void copyValue(void *dst, void *src) const
+    {
+        counters.add(TreeStats::Clones);
+        type->copyTo(dst, src);
+    }
+    void destructValue(void *p) const
+    {
+        counters.add(TreeStats::Destroys);
+        type->destruct(p);
+    }
+
+    std::unique_lock<std::recursive_mutex> serialize() const;
+    void publish();
+    void restamp();
+    void reclaim();
+    bool sharing() const { return store.use_count() > 1; }
+    bool shared(Node *nd) const { return nd->refs > 1 || (conc != Concurrency::None && nd->stamp != txn); }
+    BinaryTree *sharedCopy(Node *nd, size_t n) const;
+    BinaryTree *blank() const { return new BinaryTree(type, pol); }
+    static void *value(const Node *nd) { return nd->data; }
+    Node *own(Node *nd);
+    void release(Node *nd);
+    void retire(Node *nd);
+    std::unique_lock<std::mutex> poolLock();
+    void takeValue(Node *dst, Node *src);
+    bool searchFrom(Node *cur, void *key) const;
+    // Splay restructures on access; snapshots and lock-free readers need
+    // nodes that stay put, so those trees search and insert plainly
+    bool splaying() const { return pol == BalancePolicy::Splay && conc == Concurrency::None && !sharing(); }
+    bool splaySearch(void *key);
+    void semiSplay(PathStack<Node> &path, Node *x);
+    Node *lift(Node *nd, bool left);
+    Iterator bound(void *key, bool upper) const;
 
-    bool insertRec(Node *&nd, void *d);
-    Node *removeRec(Node *nd, void *key, bool &rem);
-    Node *findMin(Node *nd) const;
-    void inorderRec(Node *nd, std::ostringstream &os) const;
-    void destroyRec(Node *nd);
-    int height(Node *nd) const;
+    Node *rawNode();
+    Node *newNode(void *d);
+    Node *rawCopy(void *d) { return newNode(d); }
+    void freeNode(Node *nd);
+    void link(PathStack<Node> &path, Node *nd);
+    void setOp(Core::SetOp op, const TreeEngine &other);
+    bool insertMoved(void *src);
+    Node *parsedNode(std::string_view tok);
+    void thaw();
+    void *frozenSlot(size_t k) const;
+    bool searchFrozen(void *key) const;
+    void destroyAll(Node *nd);
 };
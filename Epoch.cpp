@@ -0,0 +1,94 @@
+#include "Epoch.h"
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+
+namespace
+{
+    const std::size_t maxThreads = 256;
+
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> epoch{0}; // 0: not inside a Guard
+        std::atomic<bool> taken{false};
+    };
+
+    Slot slots[maxThreads];
+    std::atomic<std::size_t> highWater{0}; // slots beyond it were never claimed
+    std::atomic<std::uint64_t> global{1};
+
+    // one slot per thread, claimed on first use and handed back at thread exit
+    struct Registration
+    {
+        Slot *slot = nullptr;
+        unsigned depth = 0;
+
+        Slot &get()
+        {
+            for (std::size_t i = 0; !slot && i < maxThreads; ++i)
+            {
+                bool f = false;
+                if (slots[i].taken.compare_exchange_strong(f, true))
+                {
+                    slot = &slots[i];
+                    std::size_t hw = highWater.load();
+                    while (hw < i + 1 && !highWater.compare_exchange_weak(hw, i + 1))
+                        ;
+                }
+            }
+            if (!slot)
+                throw std::runtime_error("too many reader threads");
+            return *slot;
+        }
+        ~Registration()
+        {
+            if (slot)
+            {
+                slot->epoch.store(0);
+                slot->taken.store(false);
+            }
+        }
+    };
+
+    thread_local Registration self;
+}
+
+Epoch::Guard::Guard()
+{
+    Slot &s = self.get();
+    if (self.depth++ == 0)
+        s.epoch.store(global.load());
+}
+
+Epoch::Guard::~Guard()
+{
+    if (--self.depth == 0)
+        self.slot->epoch.store(0);
+}
+
+std::uint64_t Epoch::advance()
+{
+    return global.fetch_add(1);
+}
+
+std::uint64_t Epoch::oldestActive()
+{
+    std::uint64_t m = std::numeric_limits<std::uint64_t>::max();
+    std::size_t n = highWater.load();
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        std::uint64_t e = slots[i].epoch.load();
+        if (e && e < m)
+            m = e;
+    }
+    return m;
+}
+
+void Epoch::synchronize()
+{
+    std::uint64_t r = advance();
+    while (oldestActive() <= r)
+        std::this_thread::yield();
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+
+// Epoch-based reclamation for lock-free readers. A reader announces the
+// current epoch for as long as an Epoch::Guard lives; memory unlinked before
+// advance() returned r may be freed once oldestActive() > r.
+class Epoch
+{
+public:
+    class Guard
+    {
+    public:
+        Guard();
+        ~Guard();
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    static std::uint64_t advance();      // ends the current epoch and returns it
+    static std::uint64_t oldestActive(); // UINT64_MAX when no reader is inside a Guard
+    static void synchronize();           // waits until readers active now have left
+};
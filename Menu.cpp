@@ -1,211 +1,682 @@
 #include "Menu.h"
 #include "BinaryTree.h"
+#include "TypedBinaryTree.h"
 #include "Types.h"
 #include <iostream>
 #include <sstream>
 #include <unordered_map>
 #include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <charconv>
+#include <streambuf>
+#include <typeinfo>
 
-void MenuTree::run()
+namespace
 {
-    std::unordered_map<std::string, std::unique_ptr<BinaryTree>> trees;
-    std::unordered_map<std::string, std::unique_ptr<Type>> types;
-    std::string current;
+    enum class Op
+    {
+        Create,
+        Select,
+        Nth,
+        Rank,
+        Count,
+        Insert,
+        Search,
+        SearchMany,
+        Remove,
+        Print,
+        Range,
+        Pairs,
+        Balance,
+        Freeze,
+        Load,
+        Merge,
+        Intersect,
+        Diff,
+        Subtree,
+        Snapshot,
+        Drop,
+        Contains,
+        Path,
+        Stats,
+        Unknown
+    };
+
+    Op opcode(std::string_view cmd)
+    {
+        static const std::unordered_map<std::string_view, Op> table = {
+            {"CREATE", Op::Create},
+            {"SELECT", Op::Select},
+            {"NTH", Op::Nth},
+            {"RANK", Op::Rank},
+            {"COUNT", Op::Count},
+            {"INSERT", Op::Insert},
+            {"SEARCH", Op::Search},
+            {"SEARCH_MANY", Op::SearchMany},
+            {"REMOVE", Op::Remove},
+            {"PRINT", Op::Print},
+            {"RANGE", Op::Range},
+            {"PAIRS", Op::Pairs},
+            {"BALANCE", Op::Balance},
+            {"FREEZE", Op::Freeze},
+            {"LOAD", Op::Load},
+            {"MERGE", Op::Merge},
+            {"INTERSECT", Op::Intersect},
+            {"DIFF", Op::Diff},
+            {"SUBTREE", Op::Subtree},
+            {"SNAPSHOT", Op::Snapshot},
+            {"DROP", Op::Drop},
+            {"CONTAINS", Op::Contains},
+            {"PATH", Op::Path},
+            {"STATS", Op::Stats},
+        };
+        auto it = table.find(cmd);
+        return it == table.end() ? Op::Unknown : it->second;
+    }
+
+    // same set as isspace in the "C" locale, which operator>> splits on
+    bool space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
 
-    auto parseValue = [&](const std::string &s)
+    // whitespace-separated words of one command line
+    class Words
     {
-        Type *t = types.at(current).get();
-        return t->createFromString(s);
+    public:
+        explicit Words(std::string_view line) : s(line), pos(0) {}
+        std::string_view next() // empty once the line is used up
+        {
+            while (pos < s.size() && space(s[pos]))
+                ++pos;
+            size_t start = pos;
+            while (pos < s.size() && !space(s[pos]))
+                ++pos;
+            return s.substr(start, pos - start);
+        }
+        std::string_view rest() const { return s.substr(pos); } // what getline would return
+
+    private:
+        std::string_view s;
+        size_t pos;
     };
 
-    std::string line;
-    while (std::getline(std::cin, line))
+    // operator>> on an integer: leading digits, false when there are none
+    bool toUnsigned(std::string_view w, size_t &out)
+    {
+        std::string s(w);
+        char *end = nullptr;
+        unsigned long long v = std::strtoull(s.c_str(), &end, 10);
+        if (end == s.c_str())
+            return false;
+        out = static_cast<size_t>(v);
+        return true;
+    }
+}
+
+// Lines and tokens over a text buffer. Built on a stream it refills one
+// line at a time, so interactive commands are answered as they arrive.
+class MenuTree::Reader
+{
+public:
+    explicit Reader(std::string_view text) : buf(text), pos(0), is(nullptr) {}
+    explicit Reader(std::istream &s) : pos(0), is(&s) {}
+
+    bool line(std::string_view &ln)
+    {
+        if (pos >= buf.size() && !refill())
+            return false;
+        size_t nl = buf.find('\n', pos);
+        if (nl == std::string_view::npos)
+            nl = buf.size();
+        ln = buf.substr(pos, nl - pos);
+        pos = nl + 1;
+        return true;
+    }
+    // next word across line ends, as std::cin >> does; the view lasts
+    // until the following call
+    bool token(std::string_view &tok)
+    {
+        for (;;)
+        {
+            while (pos < buf.size() && space(buf[pos]))
+                ++pos;
+            if (pos < buf.size())
+                break;
+            if (!refill())
+                return false;
+        }
+        size_t start = pos;
+        while (pos < buf.size() && !space(buf[pos]))
+            ++pos;
+        tok = buf.substr(start, pos - start);
+        return true;
+    }
+
+private:
+    bool refill()
+    {
+        if (!is || !std::getline(*is, hold))
+            return false;
+        hold += '\n';
+        buf = hold;
+        pos = 0;
+        return true;
+    }
+
+    std::string_view buf;
+    size_t pos;
+    std::istream *is;
+    std::string hold;
+};
+
+// Replies are appended to one buffer and handed to the sink once it holds
+// flushAt bytes; the ostream view serves Type::print and printTree.
+class MenuTree::Output : public std::streambuf
+{
+public:
+    Output(std::ostream &s, size_t flushAt) : os(this), sink(s), limit(flushAt) { buf.reserve(flushAt + 4096); }
+    ~Output() { flush(); }
+
+    Output &operator<<(std::string_view s)
+    {
+        buf.append(s.data(), s.size());
+        return *this;
+    }
+    Output &operator<<(char c)
+    {
+        buf.push_back(c);
+        return *this;
+    }
+    Output &operator<<(size_t n)
+    {
+        char tmp[24];
+        auto r = std::to_chars(tmp, tmp + sizeof(tmp), n);
+        buf.append(tmp, r.ptr - tmp);
+        return *this;
+    }
+    std::ostream &stream() { return os; }
+    void commandDone()
+    {
+        if (buf.size() >= limit)
+            flush();
+    }
+    void flush()
+    {
+        sink.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+        sink.flush();
+        buf.clear();
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (c != traits_type::eof())
+            buf.push_back(static_cast<char>(c));
+        return c;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        buf.append(s, static_cast<size_t>(n));
+        return n;
+    }
+
+private:
+    std::ostream os;
+    std::ostream &sink;
+    std::string buf;
+    size_t limit;
+};
+
+void MenuTree::run()
+{
+    Reader in(std::cin);
+    Output out(std::cout, 0);
+    std::string_view line;
+    while (in.line(line))
     {
         if (line.empty())
             continue;
-        std::istringstream iss(line);
-        std::string cmd;
-        iss >> cmd;
-
-        if (cmd == "CREATE")
-        {
-            std::string name, tp;
-            iss >> name >> tp;
-            Type *t = nullptr;
-            if (tp == "INT")
-                t = new IntType();
-            else if (tp == "DOUBLE")
-                t = new DoubleType();
-            else if (tp == "COMPLEX")
-                t = new ComplexType();
-            else if (tp == "STRING")
-                t = new StringType();
-            else if (tp == "FUNCTION")
-                t = new FunctionType();
-            else if (tp == "PERSON")
-                t = new PersonType();
-            else
-            {
-                std::cout << "Unknown type\n";
-                continue;
-            }
+        execute(line, in, out);
+        out.commandDone();
+    }
+}
+
+bool MenuTree::runBatch(const std::string &path)
+{
+    // text mode, so line ends read the same as through std::cin
+    std::FILE *f = std::fopen(path.c_str(), "r");
+    if (!f)
+    {
+        std::cerr << "Cannot open " << path << "\n";
+        return false;
+    }
+    std::string text;
+    std::fseek(f, 0, SEEK_END);
+    long size = std::ftell(f);
+    std::fseek(f, 0, SEEK_SET);
+    text.resize(size > 0 ? static_cast<size_t>(size) : 0);
+    text.resize(std::fread(&text[0], 1, text.size(), f));
+    std::fclose(f);
 
-            types[name].reset(t);
-            trees[name].reset(new BinaryTree(t));
-            current = name;
-            std::cout << "Created " << name << "\n";
+    Reader in(text);
+    Output out(std::cout, 1 << 20);
+    std::string_view line;
+    while (in.line(line))
+    {
+        if (line.empty())
+            continue;
+        try
+        {
+            execute(line, in, out);
         }
-        else if (cmd == "SELECT")
+        catch (...)
         {
-            std::string name;
-            iss >> name;
-            if (!trees.count(name))
-            {
-                std::cout << "No such tree\n";
-                continue;
-            }
-            current = name;
-            std::cout << "Selected " << name << "\n";
-        }
-        else if (cmd == "INSERT")
-        {
-            std::string v;
-            iss >> v;
-            void *e = parseValue(v);
-            bool ok = trees[current]->insertRaw(e);
-            std::cout << (ok ? "Inserted " : "Exists ") << v << "\n";
-        }
-        else if (cmd == "SEARCH")
-        {
-            std::string v;
-            iss >> v;
-            void *e = parseValue(v);
-            bool ok = trees[current]->searchRaw(e);
-            std::cout << (ok ? "Found " : "Not found ") << v << "\n";
-            types[current]->destroy(e);
-        }
-        else if (cmd == "REMOVE")
-        {
-            std::string v;
-            iss >> v;
-            void *e = parseValue(v);
-            bool ok = trees[current]->removeRaw(e);
-            std::cout << (ok ? "Removed " : "No such ") << v << "\n";
-        }
-        else if (cmd == "PRINT")
-        {
-            std::string ord;
-            iss >> ord;
-            if (ord == "IN")
-                std::cout << trees[current]->toStringInorder() << "\n";
-            else if (ord == "PRE")
-                std::cout << trees[current]->toStringPreorder() << "\n";
-            else if (ord == "POST")
-                std::cout << trees[current]->toStringPostorder() << "\n";
-            else if (ord == "FORM")
-                std::cout << trees[current]->toStringFormatted() << "\n";
-            else if (ord == "TREE")
-                trees[current]->printTree(std::cout);
-            else
-                std::cout << "Unknown order\n";
+            // keep the replies that came before the failing command
+            out.flush();
+            throw;
+        }
+        out.commandDone();
+    }
+    return true;
+}
+
+TreeEngine *MenuTree::find(const std::string &name) const
+{
+    auto t = trees.find(name);
+    return t == trees.end() ? nullptr : t->second.get();
+}
+
+void MenuTree::select(const std::string &name)
+{
+    current = name;
+    cur = find(name);
+    auto ty = types.find(name);
+    curType = ty == types.end() ? nullptr : ty->second.get();
+}
+
+const Type &MenuTree::valueType() const
+{
+    return *types.at(current);
+}
+
+// the tree for a command that combines it with the current one, or nullptr
+// after the reply saying why not
+TreeEngine *MenuTree::operand(const std::string &name, Output &out) const
+{
+    TreeEngine *e = find(name);
+    if (!e)
+        out << "No such tree\n";
+    else if (typeid(*types.at(name)) != typeid(*curType))
+    {
+        out << "Type mismatch\n";
+        e = nullptr;
+    }
+    return e;
+}
+
+void MenuTree::execute(std::string_view line, Reader &in, Output &out)
+{
+    Words w(line);
+    Op op = opcode(w.next());
+    // the rest work on the current tree, which DROP may have taken away
+    if (!cur && op != Op::Create && op != Op::Select && op != Op::Snapshot && op != Op::Drop && op != Op::Unknown)
+    {
+        out << "No tree selected\n";
+        return;
+    }
+    switch (op)
+    {
+    case Op::Create:
+    {
+        std::string name(w.next());
+        std::string_view tp = w.next(), pl = w.next();
+        BalancePolicy pol = BalancePolicy::None;
+        if (pl == "AVL")
+            pol = BalancePolicy::AVL;
+        else if (pl == "SPLAY")
+            pol = BalancePolicy::Splay;
+        else if (!pl.empty())
+        {
+            out << "Unknown policy\n";
+            break;
         }
-        else if (cmd == "PAIRS")
+        Type *t = nullptr;
+        if (tp == "INT")
+            t = new IntType();
+        else if (tp == "DOUBLE")
+            t = new DoubleType();
+        else if (tp == "COMPLEX")
+            t = new ComplexType();
+        else if (tp == "STRING")
+            t = new StringType();
+        else if (tp == "FUNCTION")
+            t = new FunctionType();
+        else if (tp == "PERSON")
+            t = new PersonType();
+        else
         {
-            auto vec = trees[current]->toPairList();
-            for (auto &pr : vec)
-            {
-                types[current]->print(pr.first, std::cout);
-                std::cout << " - ";
-                if (pr.second)
-                    types[current]->print(pr.second, std::cout);
-                else
-                    std::cout << "NULL";
-                std::cout << "\n";
-            }
+            out << "Unknown type\n";
+            break;
         }
-        else if (cmd == "BALANCE")
+
+        trees.erase(name);
+        types[name].reset(t);
+        TreeEngine *e = makeTypedEngine(t, pol);
+        trees[name].reset(e ? e : new BinaryTree(t, pol));
+        select(name);
+        out << "Created " << name << '\n';
+        break;
+    }
+    case Op::Select:
+    {
+        std::string name(w.next());
+        if (!trees.count(name))
         {
-            trees[current]->balance();
-            std::cout << "Balanced\n";
+            out << "No such tree\n";
+            break;
         }
-        else if (cmd == "LOAD")
+        select(name);
+        out << "Selected " << name << '\n';
+        break;
+    }
+    case Op::Nth:
+    {
+        // the value with k smaller ones
+        std::string_view k = w.next();
+        size_t i = 0;
+        auto r = std::from_chars(k.data(), k.data() + k.size(), i);
+        if (r.ec != std::errc() || r.ptr != k.data() + k.size())
         {
-            std::string sub;
-            iss >> sub;
-            if (sub == "STR")
-            {
-                std::string ord;
-                iss >> ord;
-                std::string rest;
-                std::getline(iss, rest);
-                trees[current]->fromStringTraversal(rest, ord);
-                std::cout << "Loaded from str\n";
-            }
-            else if (sub == "FORM")
-            {
-                std::string rest;
-                std::getline(iss, rest);
-                trees[current]->fromFormattedString(rest);
-                std::cout << "Loaded formatted\n";
-            }
-            else if (sub == "PAIRS")
-            {
-                int n;
-                iss >> n;
-                std::vector<std::pair<void *, void *>> pairs;
-                for (int i = 0; i < n; ++i)
-                {
-                    std::string a, b;
-                    std::cin >> a >> b;
-                    void *va = types[current]->createFromString(a);
-                    void *vb = (b == "NULL" ? nullptr : types[current]->createFromString(b));
-                    pairs.emplace_back(va, vb);
-                }
-                trees[current]->fromPairList(pairs);
-                std::cout << "Loaded pairs\n";
-            }
+            out << "Invalid index\n";
+            break;
         }
-        else if (cmd == "MERGE")
+        cur->enableOrderStatistics();
+        void *v = cur->select(i);
+        if (!v)
+            out << "No node\n";
+        else
         {
-            std::string other;
-            iss >> other;
-            trees[current]->merge(*trees[other]);
-            std::cout << "Merged " << other << "\n";
+            curType->print(v, out.stream());
+            out << '\n';
         }
-        else if (cmd == "SUBTREE")
+        break;
+    }
+    case Op::Rank:
+    {
+        ParsedValue e(valueType(), w.next());
+        cur->enableOrderStatistics();
+        out << cur->rank(e.get()) << '\n';
+        break;
+    }
+    case Op::Count:
+    {
+        std::string_view lo = w.next(), hi = w.next();
+        ParsedValue a(valueType(), lo);
+        ParsedValue b(valueType(), hi);
+        cur->enableOrderStatistics();
+        out << cur->countRange(a.get(), b.get()) << '\n';
+        break;
+    }
+    case Op::Insert:
+    {
+        std::string_view v = w.next();
+        bool ok = cur->emplaceFromString(v);
+        out << (ok ? "Inserted " : "Exists ") << v << '\n';
+        break;
+    }
+    case Op::Search:
+    {
+        std::string_view v = w.next();
+        ParsedValue e(valueType(), v);
+        bool ok = cur->accessRaw(e.get());
+        out << (ok ? "Found " : "Not found ") << v << '\n';
+        break;
+    }
+    case Op::SearchMany:
+    {
+        const Type *t = &valueType();
+        std::vector<std::string_view> vals;
+        for (std::string_view v = w.next(); !v.empty(); v = w.next())
+            vals.push_back(v);
+        std::vector<char> keys(vals.size() * t->size());
+        for (size_t i = 0; i < vals.size(); ++i)
+            t->parseTo(&keys[i * t->size()], vals[i]);
+        std::unique_ptr<bool[]> found(new bool[vals.size()]);
+        cur->searchBatch(keys.data(), vals.size(), found.get());
+        for (size_t i = 0; i < vals.size(); ++i)
         {
-            std::string v;
-            iss >> v;
-            void *e = parseValue(v);
-            BinaryTree *sub = trees[current]->subtree(e);
-            std::string name2 = current + "_sub";
-            trees[name2].reset(sub);
-            types[name2].reset(types[current]->cloneType());
-            std::cout << "Subtree " << name2 << "\n";
+            out << (found[i] ? "Found " : "Not found ") << vals[i] << '\n';
+            t->destruct(&keys[i * t->size()]);
         }
-        else if (cmd == "CONTAINS")
+        break;
+    }
+    case Op::Remove:
+    {
+        std::string_view v = w.next();
+        ParsedValue e(valueType(), v);
+        bool ok = cur->removeRaw(e.get());
+        out << (ok ? "Removed " : "No such ") << v << '\n';
+        break;
+    }
+    case Op::Print:
+    {
+        std::string_view ord = w.next();
+        if (ord == "IN")
+            out << cur->toStringInorder() << '\n';
+        else if (ord == "PRE")
+            out << cur->toStringPreorder() << '\n';
+        else if (ord == "POST")
+            out << cur->toStringPostorder() << '\n';
+        else if (ord == "FORM")
+            out << cur->toStringFormatted() << '\n';
+        else if (ord == "TREE")
+            cur->printTree(out.stream());
+        else
+            out << "Unknown order\n";
+        break;
+    }
+    case Op::Range:
+    {
+        std::string_view lo = w.next(), hi = w.next(), opt = w.next();
+        size_t limit = SIZE_MAX;
+        if (!opt.empty() && (opt != "LIMIT" || !toUnsigned(w.next(), limit)))
         {
-            std::string other;
-            iss >> other;
-            bool ok = trees[current]->containsSubtree(*trees[other]);
-            std::cout << (ok ? "Yes" : "No") << "\n";
+            out << "Unknown option\n";
+            break;
         }
-        else if (cmd == "PATH")
+        Type *t = curType;
+        ParsedValue a(valueType(), lo);
+        ParsedValue b(valueType(), hi);
+        std::ostringstream os;
+        if (limit)
+            cur->rangeRaw(a.get(), b.get(), [&](void *v)
+                          {
+                t->print(v, os);
+                os << ' ';
+                return --limit > 0; });
+        std::string s = os.str();
+        if (!s.empty())
+            s.pop_back();
+        out << s << '\n';
+        break;
+    }
+    case Op::Pairs:
+    {
+        auto vec = cur->toPairList();
+        for (auto &pr : vec)
         {
-            std::string path;
-            iss >> path;
-            void *r = trees[current]->searchByPathRaw(path);
-            if (!r)
-                std::cout << "No node\n";
+            curType->print(pr.first, out.stream());
+            out << " - ";
+            if (pr.second)
+                curType->print(pr.second, out.stream());
             else
+                out << "NULL";
+            out << '\n';
+        }
+        break;
+    }
+    case Op::Balance:
+        cur->balance();
+        out << "Balanced\n";
+        break;
+    case Op::Freeze:
+        cur->freeze();
+        out << "Frozen\n";
+        break;
+    case Op::Load:
+    {
+        std::string_view sub = w.next();
+        if (sub == "STR")
+        {
+            std::string ord(w.next());
+            cur->fromStringTraversal(std::string(w.rest()), ord);
+            out << "Loaded from str\n";
+        }
+        else if (sub == "FORM")
+        {
+            cur->fromFormattedString(std::string(w.rest()));
+            out << "Loaded formatted\n";
+        }
+        else if (sub == "PAIRS")
+        {
+            size_t n = 0;
+            std::string_view count = w.next();
+            if (!count.empty() && count[0] != '-')
+                toUnsigned(count, n);
+            // the pairs follow on the next lines
+            std::vector<std::pair<void *, void *>> pairs;
+            for (size_t i = 0; i < n; ++i)
             {
-                types[current]->print(r, std::cout);
-                std::cout << "\n";
+                std::string_view tok;
+                std::string a = in.token(tok) ? std::string(tok) : std::string();
+                std::string b = in.token(tok) ? std::string(tok) : std::string();
+                void *va = curType->createFromString(a);
+                void *vb = (b == "NULL" ? nullptr : curType->createFromString(b));
+                pairs.emplace_back(va, vb);
             }
+            cur->fromPairListOwned(pairs);
+            out << "Loaded pairs\n";
+        }
+        break;
+    }
+    case Op::Merge:
+    {
+        std::string other(w.next());
+        TreeEngine *o = operand(other, out);
+        if (!o)
+            break;
+        cur->unionWith(*o);
+        out << "Merged " << other << '\n';
+        break;
+    }
+    case Op::Intersect:
+    {
+        std::string other(w.next());
+        TreeEngine *o = operand(other, out);
+        if (!o)
+            break;
+        cur->intersectWith(*o);
+        out << "Intersected " << other << '\n';
+        break;
+    }
+    case Op::Diff:
+    {
+        std::string other(w.next());
+        TreeEngine *o = operand(other, out);
+        if (!o)
+            break;
+        cur->differenceWith(*o);
+        out << "Subtracted " << other << '\n';
+        break;
+    }
+    case Op::Subtree:
+    {
+        std::string_view v = w.next(), mode = w.next();
+        if (!mode.empty() && mode != "COW")
+        {
+            out << "Unknown option\n";
+            break;
         }
+        TreeEngine *sub = cur->subtree(ParsedValue(valueType(), v).get(), mode == "COW");
+        std::string name2 = current + "_sub";
+        trees[name2].reset(sub);
+        types[name2] = types[current];
+        out << "Subtree " << name2 << '\n';
+        break;
+    }
+    case Op::Snapshot:
+    {
+        std::string name(w.next());
+        if (name.empty())
+            name = current;
+        TreeEngine *e = find(name);
+        if (!e)
+        {
+            out << "No such tree\n";
+            break;
+        }
+        std::string version = name + "@" + std::to_string(++versions[name]);
+        trees[version].reset(e->snapshot());
+        types[version] = types[name];
+        out << "Snapshot " << version << '\n';
+        break;
+    }
+    case Op::Drop:
+    {
+        std::string name(w.next());
+        if (!trees.erase(name))
+        {
+            out << "No such tree\n";
+            break;
+        }
+        types.erase(name);
+        if (current == name)
+            select(std::string());
+        out << "Dropped " << name << '\n';
+        break;
+    }
+    case Op::Contains:
+    {
+        std::string other(w.next());
+        TreeEngine *o = operand(other, out);
+        if (!o)
+            break;
+        bool ok = cur->containsSubtree(*o);
+        out << (ok ? "Yes" : "No") << '\n';
+        break;
+    }
+    case Op::Path:
+    {
+        void *r = cur->searchByPathRaw(std::string(w.next()));
+        if (!r)
+            out << "No node\n";
         else
         {
-            std::cout << "Unknown command\n";
+            curType->print(r, out.stream());
+            out << '\n';
+        }
+        break;
+    }
+    case Op::Stats:
+    {
+        // one JSON line; counters stay at zero unless built with TREE_STATS
+        std::string_view opt = w.next();
+        if (!opt.empty() && opt != "RESET")
+        {
+            out << "Unknown option\n";
+            break;
+        }
+        if (opt == "RESET")
+        {
+            cur->resetStats();
+            out << "Stats reset\n";
         }
+        else
+            out << cur->statsJson() << '\n';
+        break;
+    }
+    case Op::Unknown:
+        out << "Unknown command\n";
+        break;
     }
 }
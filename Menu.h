@@ -1,8 +1,34 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <memory>
+#include <unordered_map>
+#include <iostream>
+#include "Types.h"
+#include "TreeEngine.h"
 
 class MenuTree
 {
 public:
-    void run();
+    void run();                             // commands from std::cin, replies after each one
+    bool runBatch(const std::string &path); // whole file at once, replies in large writes
+
+private:
+    class Reader;
+    class Output;
+
+    void execute(std::string_view line, Reader &in, Output &out);
+    void select(const std::string &name);
+    TreeEngine *find(const std::string &name) const; // nullptr too for a SUBTREE that found nothing
+    TreeEngine *operand(const std::string &name, Output &out) const;
+    const Type &valueType() const; // of the current tree, throws without one
+
+    // types outlive the trees that point at them; subtrees and snapshots
+    // share their parent's type
+    std::unordered_map<std::string, std::shared_ptr<Type>> types;
+    std::unordered_map<std::string, int> versions;
+    std::unordered_map<std::string, std::unique_ptr<TreeEngine>> trees;
+    std::string current;
+    TreeEngine *cur = nullptr; // trees[current]
+    Type *curType = nullptr;   // types[current]
 };
@@ -0,0 +1,15 @@
+@echo off
+rem Собираем бенчмарк
+
+g++ -std=c++17 -O2 -Wall -Wextra bench.cpp BinaryTree.cpp ShardedTree.cpp BatchSearch.cpp Epoch.cpp -o tree_bench.exe -lpsapi
+if %ERRORLEVEL% neq 0 (
+    echo Компиляция не удалась.
+    pause
+    exit /b %ERRORLEVEL%
+)
+
+rem Размеры от 1K до 1M; для прогона до 10M: tree_bench.exe --max 10000000
+tree_bench.exe > bench_output.txt
+
+echo Готово. Результаты в bench_output.txt
+pause
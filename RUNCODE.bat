@@ -1,7 +1,7 @@
 @echo off
 rem Собираем проект
 
-g++ -std=c++17 -O2 main.cpp Menu.cpp BinaryTree.cpp -o tree_app.exe
+g++ -std=c++17 -O2 -Wall -Wextra main.cpp Menu.cpp BinaryTree.cpp BatchSearch.cpp Epoch.cpp -o tree_app.exe
 if %ERRORLEVEL% neq 0 (
     echo Компиляция не удалась.
     pause
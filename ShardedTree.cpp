@@ -0,0 +1,221 @@
+#include "ShardedTree.h"
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <sstream>
+
+ShardedTree::ShardedTree(Type *t, const std::vector<void *> &b, unsigned threads, BalancePolicy p)
+    : type(t), pol(p), adaptive(false), pool(threads > 1 ? threads - 1 : 0)
+{
+    for (void *v : b)
+        bounds.push_back(type->clone(v));
+    for (size_t i = 0; i <= bounds.size(); ++i)
+        shards.push_back(std::make_unique<Shard>(type, pol));
+}
+ShardedTree::ShardedTree(Type *t, size_t n, unsigned threads, BalancePolicy p)
+    : type(t), pol(p), adaptive(true), pool(threads > 1 ? threads - 1 : 0)
+{
+    for (size_t i = 0; i < std::max<size_t>(n, 1); ++i)
+        shards.push_back(std::make_unique<Shard>(type, pol));
+}
+ShardedTree::~ShardedTree()
+{
+    for (void *v : bounds)
+        type->destroy(v);
+}
+
+// number of bounds <= v
+size_t ShardedTree::shardOf(void *v) const
+{
+    size_t lo = 0, hi = bounds.size();
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (type->compare(bounds[mid], v) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool ShardedTree::insertRaw(void *d)
+{
+    std::shared_lock<std::shared_mutex> lk(layout);
+    Shard &s = *shards[shardOf(d)];
+    std::lock_guard<std::mutex> g(s.m);
+    return s.tree.insertRaw(d);
+}
+bool ShardedTree::searchRaw(void *key) const
+{
+    std::shared_lock<std::shared_mutex> lk(layout);
+    Shard &s = *shards[shardOf(key)];
+    std::lock_guard<std::mutex> g(s.m);
+    return s.tree.accessRaw(key); // the shard is ours alone, so a Splay one may adapt
+}
+bool ShardedTree::removeRaw(void *key)
+{
+    std::shared_lock<std::shared_mutex> lk(layout);
+    Shard &s = *shards[shardOf(key)];
+    std::lock_guard<std::mutex> g(s.m);
+    return s.tree.removeRaw(key);
+}
+
+// Routes every value to its shard in parallel chunks, groups the indices by
+// shard (stable, so the first of equal values wins) and then fills all
+// shards at once, each under its own lock.
+size_t ShardedTree::insertBatch(const void *values, size_t n)
+{
+    const char *p = static_cast<const char *>(values);
+    const size_t sz = type->size();
+    if (adaptive)
+    {
+        std::unique_lock<std::shared_mutex> lk(layout);
+        if (bounds.empty() && shards.size() > 1)
+        {
+            if (total() == 0)
+                pickBounds(p, n);
+            else
+                rebalanceLocked();
+        }
+    }
+
+    std::shared_lock<std::shared_mutex> lk(layout);
+    const size_t count = shards.size();
+    std::vector<std::uint32_t> home(n);
+    const size_t chunk = 4096;
+    parallelFor(0, (n + chunk - 1) / chunk, [&](size_t c)
+                {
+        for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); ++i)
+            home[i] = static_cast<std::uint32_t>(shardOf(const_cast<char *>(p + i * sz))); });
+    std::vector<size_t> start(count + 1, 0), order(n);
+    for (std::uint32_t h : home)
+        ++start[h + 1];
+    std::partial_sum(start.begin(), start.end(), start.begin());
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; ++i)
+        order[fill[home[i]]++] = i;
+
+    std::atomic<size_t> added(0);
+    parallelFor(0, count, [&](size_t s)
+                {
+        Shard &sh = *shards[s];
+        std::lock_guard<std::mutex> g(sh.m);
+        size_t k = 0;
+        for (size_t j = start[s]; j < start[s + 1]; ++j)
+            k += sh.tree.insertRaw(const_cast<char *>(p + order[j] * sz));
+        added += k; });
+    bool uneven = adaptive && lopsided();
+    lk.unlock();
+    if (uneven)
+        rebalance();
+    return added;
+}
+
+// quantiles of an evenly spaced sample of the first batch
+void ShardedTree::pickBounds(const char *values, size_t n)
+{
+    const size_t sz = type->size();
+    size_t m = std::min(n, 64 * shards.size());
+    std::vector<void *> sample;
+    sample.reserve(m);
+    for (size_t i = 0; i < m; ++i)
+        sample.push_back(const_cast<char *>(values + i * n / m * sz));
+    std::sort(sample.begin(), sample.end(), [&](void *a, void *b)
+              { return type->compare(a, b) < 0; });
+    setBounds(sample, sample.size());
+}
+// bounds at sorted[k * n / shards], skipping repeats
+void ShardedTree::setBounds(const std::vector<void *> &sorted, size_t n)
+{
+    for (void *v : bounds)
+        type->destroy(v);
+    bounds.clear();
+    for (size_t k = 1; k < shards.size(); ++k)
+    {
+        size_t i = k * n / shards.size();
+        if (i >= n)
+            break;
+        void *v = sorted[i];
+        if (bounds.empty() || type->compare(bounds.back(), v) < 0)
+            bounds.push_back(type->clone(v));
+    }
+}
+// some shard holds more than twice its share; small forests never count
+bool ShardedTree::lopsided() const
+{
+    size_t sum = 0, largest = 0;
+    for (auto &s : shards)
+    {
+        std::lock_guard<std::mutex> g(s->m);
+        sum += s->tree.size();
+        largest = std::max(largest, s->tree.size());
+    }
+    return sum >= 1024 * shards.size() && largest > 2 * sum / shards.size();
+}
+
+void ShardedTree::rebalance()
+{
+    std::unique_lock<std::shared_mutex> lk(layout);
+    rebalanceLocked();
+}
+// The shards are ranges in order, so their in-order values together are
+// sorted: new bounds are quantiles and every new shard is an O(k) bulk load.
+void ShardedTree::rebalanceLocked()
+{
+    std::vector<void *> all;
+    all.reserve(total());
+    for (auto &s : shards)
+        for (void *v : s->tree)
+            all.push_back(v);
+    setBounds(all, all.size());
+    std::vector<size_t> start(shards.size() + 1, all.size());
+    start[0] = 0;
+    for (size_t s = 0, j = 0; s < bounds.size(); ++s)
+    {
+        while (j < all.size() && type->compare(all[j], bounds[s]) < 0)
+            ++j;
+        start[s + 1] = j;
+    }
+    std::vector<std::unique_ptr<Shard>> fresh(shards.size());
+    parallelFor(0, fresh.size(), [&](size_t s)
+                {
+        fresh[s] = std::make_unique<Shard>(type, pol);
+        fresh[s]->tree.fromSorted(all.data() + start[s], start[s + 1] - start[s]); });
+    shards.swap(fresh);
+}
+
+size_t ShardedTree::size() const
+{
+    std::shared_lock<std::shared_mutex> lk(layout);
+    return total();
+}
+size_t ShardedTree::total() const
+{
+    size_t n = 0;
+    for (auto &s : shards)
+    {
+        std::lock_guard<std::mutex> g(s->m);
+        n += s->tree.size();
+    }
+    return n;
+}
+size_t ShardedTree::shardSize(size_t i) const
+{
+    std::shared_lock<std::shared_mutex> lk(layout);
+    std::lock_guard<std::mutex> g(shards[i]->m);
+    return shards[i]->tree.size();
+}
+
+std::string ShardedTree::toStringInorder() const
+{
+    std::ostringstream os;
+    forEach([&](void *v)
+            {
+        type->print(v, os);
+        os << ' '; });
+    std::string s = os.str();
+    if (!s.empty())
+        s.pop_back();
+    return s;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include "BinaryTree.h"
+#include "ThreadPool.h"
+
+// Range-partitioned forest of BinaryTrees. Shard i holds the values v with
+// bounds[i - 1] <= v < bounds[i], so an in-order walk is the shards' walks
+// back to back. Every shard has its own mutex: calls from different threads
+// contend only within a shard, and insertBatch inserts into all shards at
+// once on its own pool of workers.
+//
+// Bounds are either given up front or adaptive: the first batch picks them
+// from a sample, and whenever a batch leaves one shard with more than twice
+// its fair share the values are redistributed at the quantiles.
+class ShardedTree
+{
+public:
+    // shards = bounds.size() + 1; bounds ascending, copied
+    ShardedTree(Type *t, const std::vector<void *> &bounds, unsigned threads = 1,
+                BalancePolicy p = BalancePolicy::AVL);
+    // adaptive bounds
+    ShardedTree(Type *t, size_t shards, unsigned threads = 1, BalancePolicy p = BalancePolicy::AVL);
+    ~ShardedTree();
+    ShardedTree(const ShardedTree &) = delete;
+    ShardedTree &operator=(const ShardedTree &) = delete;
+
+    bool insertRaw(void *d);
+    bool searchRaw(void *key) const;
+    bool removeRaw(void *key);
+    // values: n contiguous values of Type::size() bytes, as for searchBatch.
+    // Returns how many were not there yet.
+    size_t insertBatch(const void *values, size_t n);
+    // moves values between shards so that they hold equal shares
+    void rebalance();
+
+    size_t size() const;
+    size_t shardCount() const { return shards.size(); }
+    size_t shardSize(size_t i) const;
+    unsigned threads() const { return pool.size() + 1; }
+
+    // f(value) in ascending order across all shards, each locked in turn
+    template <class F>
+    void forEach(F f) const
+    {
+        std::shared_lock<std::shared_mutex> lk(layout);
+        for (auto &s : shards)
+        {
+            std::lock_guard<std::mutex> g(s->m);
+            for (void *v : s->tree)
+                f(v);
+        }
+    }
+    std::string toStringInorder() const;
+
+private:
+    struct Shard
+    {
+        mutable std::mutex m;
+        BinaryTree tree;
+        Shard(Type *t, BalancePolicy p) : tree(t, p) {}
+    };
+
+    Type *type;
+    BalancePolicy pol;
+    bool adaptive;
+    // bounds and the shard list; single-value calls and batches share it,
+    // picking and moving bounds takes it exclusively
+    mutable std::shared_mutex layout;
+    std::vector<void *> bounds; // owned copies
+    std::vector<std::unique_ptr<Shard>> shards;
+    ThreadPool pool;
+
+    size_t shardOf(void *v) const;
+    void pickBounds(const char *values, size_t n);
+    void setBounds(const std::vector<void *> &sorted, size_t n);
+    bool lopsided() const;
+    size_t total() const; // size() with the layout already locked
+    void rebalanceLocked();
+    // f(i) for i in [lo, hi), split over the pool
+    template <class F>
+    void parallelFor(size_t lo, size_t hi, const F &f)
+    {
+        if (hi - lo <= 1 || pool.size() == 0)
+        {
+            for (size_t i = lo; i < hi; ++i)
+                f(i);
+            return;
+        }
+        size_t mid = lo + (hi - lo) / 2;
+        pool.invoke([&]
+                    { parallelFor(lo, mid, f); }, [&]
+                    { parallelFor(mid, hi, f); });
+    }
+};
@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <new>
+
+// Fixed-size block allocator: blocks are carved from large slabs, freed blocks
+// go on a free list, and release() drops every slab at once in O(#slabs).
+class SlabPool
+{
+public:
+    explicit SlabPool(std::size_t blockSize)
+        : block(roundUp(blockSize)), perSlab(minSlab), cur(nullptr), left(0), freeList(nullptr), bytes(0) {}
+    ~SlabPool() { release(); }
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    void *alloc()
+    {
+        if (freeList)
+        {
+            FreeBlock *b = freeList;
+            freeList = b->next;
+            return b;
+        }
+        if (!left)
+            grow();
+        void *p = cur;
+        cur += block;
+        --left;
+        return p;
+    }
+    void free(void *p)
+    {
+        FreeBlock *b = static_cast<FreeBlock *>(p);
+        b->next = freeList;
+        freeList = b;
+    }
+    void release()
+    {
+        for (char *s : slabs)
+            ::operator delete(s);
+        slabs.clear();
+        perSlab = minSlab;
+        cur = nullptr;
+        left = 0;
+        freeList = nullptr;
+        bytes = 0;
+    }
+
+    std::size_t blockSize() const { return block; }
+    std::size_t reserved() const { return bytes; } // held in slabs, used or not
+
+    // power-of-two size class, at least one pointer wide
+    static std::size_t sizeClass(std::size_t n)
+    {
+        std::size_t c = sizeof(void *);
+        while (c < n)
+            c <<= 1;
+        return c;
+    }
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+    static constexpr std::size_t minSlab = 64;
+    static constexpr std::size_t maxSlab = 1 << 16;
+
+    std::size_t block;
+    std::size_t perSlab;
+    std::vector<char *> slabs;
+    char *cur;
+    std::size_t left;
+    FreeBlock *freeList;
+    std::size_t bytes;
+
+    static std::size_t roundUp(std::size_t n)
+    {
+        const std::size_t a = alignof(std::max_align_t);
+        if (n < sizeof(FreeBlock))
+            n = sizeof(FreeBlock);
+        return n <= a ? sizeClass(n) : (n + a - 1) / a * a;
+    }
+    void grow()
+    {
+        cur = static_cast<char *>(::operator new(block * perSlab));
+        slabs.push_back(cur);
+        bytes += block * perSlab;
+        left = perSlab;
+        if (perSlab < maxSlab)
+            perSlab <<= 1;
+    }
+};
@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool for divide-and-conquer work. invoke(a, b) queues a, runs b on
+// the calling thread, then helps with queued tasks until a is done, so nested
+// invokes never deadlock. With no workers both halves run inline.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned workers) : stopping(false)
+    {
+        for (unsigned i = 0; i < workers; ++i)
+            threads.emplace_back([this]
+                                 { loop(); });
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread &t : threads)
+            t.join();
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // one worker per hardware thread besides the caller
+    static ThreadPool &instance()
+    {
+        static ThreadPool pool(std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0);
+        return pool;
+    }
+    unsigned size() const { return static_cast<unsigned>(threads.size()); }
+
+    template <class A, class B>
+    void invoke(A &&a, B &&b)
+    {
+        if (threads.empty())
+        {
+            a();
+            b();
+            return;
+        }
+        Task t{std::function<void()>(std::forward<A>(a)), false};
+        {
+            std::lock_guard<std::mutex> lk(m);
+            queue.push_back(&t);
+        }
+        cv.notify_one();
+        b();
+        // not picked up yet: take it back and run it here
+        if (unqueue(&t))
+        {
+            t.fn();
+            return;
+        }
+        while (!t.done.load(std::memory_order_acquire))
+            if (!runOne())
+                std::this_thread::yield();
+    }
+
+private:
+    struct Task
+    {
+        std::function<void()> fn;
+        std::atomic<bool> done;
+    };
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<Task *> queue;
+    std::vector<std::thread> threads;
+    bool stopping;
+
+    bool unqueue(Task *t)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+            if (*it == t)
+            {
+                queue.erase(it);
+                return true;
+            }
+        return false;
+    }
+    bool runOne()
+    {
+        Task *t;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            if (queue.empty())
+                return false;
+            t = queue.front();
+            queue.pop_front();
+        }
+        t->fn();
+        t->done.store(true, std::memory_order_release);
+        return true;
+    }
+    void loop()
+    {
+        for (;;)
+        {
+            Task *t;
+            {
+                std::unique_lock<std::mutex> lk(m);
+                cv.wait(lk, [this]
+                        { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                t = queue.front();
+                queue.pop_front();
+            }
+            t->fn();
+            t->done.store(true, std::memory_order_release);
+        }
+    }
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <iostream>
+#include "Types.h"
+
+// AVL: height is kept O(log n) on every insert/remove
+// Splay: inserts and a sample of accessRaw hits semi-splay the node toward the
+// root, so frequently accessed values stay shallow (BinaryTree only)
+enum class BalancePolicy
+{
+    None,
+    AVL,
+    Splay
+};
+
+// common surface of the void* BinaryTree and the typed TypedBinaryTree<T, Compare>
+class TreeEngine
+{
+public:
+    virtual ~TreeEngine() = default;
+
+    virtual void clear() = 0;
+    virtual bool insertRaw(void *d) = 0; // copies *d
+    // Move the value into the node instead: insertOwned takes d, a value from
+    // Type::createFromString, and destroys it whether inserted or not.
+    virtual bool insertOwned(void *d) = 0;
+    virtual bool emplaceFromString(std::string_view s) = 0;
+    virtual bool searchRaw(void *key) const = 0; // never changes the tree
+    // searchRaw for a caller with the tree to itself: under Splay a hit may
+    // move toward the root
+    virtual bool accessRaw(void *key) { return searchRaw(key); }
+    virtual bool removeRaw(void *key) = 0;
+    virtual void searchBatch(const void *keys, size_t n, bool *out) const = 0;
+
+    virtual void balance() = 0;
+    virtual void freeze() = 0;
+
+    virtual std::string toStringInorder() const = 0;
+    virtual std::string toStringPreorder() const = 0;
+    virtual std::string toStringPostorder() const = 0;
+    virtual std::string toStringFormatted() const = 0;
+
+    virtual bool fromStringTraversal(const std::string &str, const std::string &order) = 0;
+    virtual bool fromFormattedString(const std::string &str) = 0;
+
+    virtual std::vector<std::pair<void *, void *>> toPairList() const = 0;
+    virtual bool fromPairList(const std::vector<std::pair<void *, void *>> &list) = 0; // copies the values
+    // takes every value, as insertOwned does: nodes move them in, the rest are destroyed
+    virtual bool fromPairListOwned(const std::vector<std::pair<void *, void *>> &list) = 0;
+    virtual std::vector<void *> toPreorderList() const = 0; // the values themselves, not copies
+    virtual void fromPreorder(void *const *values, size_t n) = 0; // copies, in the shape of that preorder
+
+    virtual void *searchByPathRaw(const std::string &path) const = 0;
+    virtual void printTree(std::ostream &os = std::cout) const = 0;
+
+    // Order statistics: after enableOrderStatistics() (one O(n) pass) every
+    // node keeps its subtree size and these run in O(log n); before that
+    // they walk in order from the smallest value.
+    virtual void enableOrderStatistics() = 0;
+    virtual size_t rank(void *key) const = 0;                 // values < key
+    virtual void *select(size_t k) const = 0;                 // value with k smaller ones, nullptr past the end
+    virtual size_t countRange(void *lo, void *hi) const = 0; // values in [lo, hi]
+    // Calls f(value) for the values in [lo, hi] in order until f returns
+    // false, in O(log n + k). Returns how many values f was called with.
+    virtual size_t rangeRaw(void *lo, void *hi, const std::function<bool(void *)> &f) const = 0;
+
+    // The tree operations below take another tree of the same value type.
+    // One from the other engine is first copied into this one's, in O(m).
+    virtual void unionWith(const TreeEngine &other) = 0; // other is only read
+    virtual void intersectWith(const TreeEngine &other) = 0;
+    virtual void differenceWith(const TreeEngine &other) = 0;
+    virtual bool containsSubtree(const TreeEngine &sub) const = 0; // sub appears here with the same shape
+    // Copy of the subtree under key, nullptr if key is absent. With share it
+    // links this tree's nodes and either side copies a node before changing it.
+    virtual TreeEngine *subtree(void *key, bool share = false) const = 0;
+    virtual TreeEngine *snapshot() const = 0; // an O(1) read view of the current contents
+
+    virtual BalancePolicy policy() const = 0;
+
+    // Instrumentation, see TreeStats: the counters only move in TREE_STATS
+    // builds, the rest is computed on demand in O(n).
+    virtual void resetStats() = 0;
+    virtual std::vector<size_t> depthHistogram() const = 0; // nodes per depth, root at 0
+    virtual size_t memoryEstimate() const = 0;              // bytes of the nodes in use and the frozen array
+    virtual std::string statsJson() const = 0;              // all of the above on one line
+};
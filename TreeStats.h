@@ -0,0 +1,158 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Event counters and per-operation latency for one tree. Everything
+// compiles to nothing unless the build defines TREE_STATS (g++ -DTREE_STATS);
+// then an event is one relaxed atomic add and a timed operation reads the
+// clock twice. Safe to bump from concurrent readers.
+class TreeStats
+{
+public:
+    enum Event
+    {
+        Compares,
+        Clones,   // values copied or moved into a node
+        Destroys, // values destructed
+        NodeAllocs,
+        NodeFrees,
+        Events
+    };
+    enum Op
+    {
+        Insert,
+        Search,
+        Remove,
+        Balance,
+        Ops
+    };
+
+#ifdef TREE_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    TreeStats() { reset(); }
+    TreeStats(const TreeStats &) = delete;
+    TreeStats &operator=(const TreeStats &) = delete;
+
+    void add(Event e, std::uint64_t n = 1) const
+    {
+#ifdef TREE_STATS
+        events[e].fetch_add(n, std::memory_order_relaxed);
+#else
+        (void)e;
+        (void)n;
+#endif
+    }
+
+    // counts one call of op and its wall time
+    class Timer
+    {
+    public:
+#ifdef TREE_STATS
+        Timer(const TreeStats &s, Op op) : s(s), op(op), start(std::chrono::steady_clock::now()) {}
+        ~Timer()
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+            s.calls[op].fetch_add(1, std::memory_order_relaxed);
+            s.nanos[op].fetch_add(static_cast<std::uint64_t>(ns.count()), std::memory_order_relaxed);
+        }
+
+    private:
+        const TreeStats &s;
+        Op op;
+        std::chrono::steady_clock::time_point start;
+#else
+        Timer(const TreeStats &, Op) {}
+#endif
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+    };
+
+    std::uint64_t count(Event e) const
+    {
+#ifdef TREE_STATS
+        return events[e].load(std::memory_order_relaxed);
+#else
+        (void)e;
+        return 0;
+#endif
+    }
+    std::uint64_t opCalls(Op op) const
+    {
+#ifdef TREE_STATS
+        return calls[op].load(std::memory_order_relaxed);
+#else
+        (void)op;
+        return 0;
+#endif
+    }
+    std::uint64_t opNanos(Op op) const
+    {
+#ifdef TREE_STATS
+        return nanos[op].load(std::memory_order_relaxed);
+#else
+        (void)op;
+        return 0;
+#endif
+    }
+    void reset()
+    {
+#ifdef TREE_STATS
+        for (auto &c : events)
+            c.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < Ops; ++i)
+        {
+            calls[i].store(0, std::memory_order_relaxed);
+            nanos[i].store(0, std::memory_order_relaxed);
+        }
+#endif
+    }
+
+    // the STATS line: the tree's shape and memory figures, then the counters
+    std::string json(std::size_t nodes, const std::vector<std::size_t> &hist, std::size_t used, std::size_t reserved) const
+    {
+        std::ostringstream os;
+        os << "{\"nodes\":" << nodes << ",\"height\":" << hist.size() << ",\"depth_histogram\":[";
+        for (std::size_t d = 0; d < hist.size(); ++d)
+            os << (d ? "," : "") << hist[d];
+        os << "],\"memory\":{\"used_bytes\":" << used << ",\"reserved_bytes\":" << reserved
+           << "},\"counters_enabled\":" << (enabled ? "true" : "false") << ",\"counters\":{";
+        for (int e = 0; e < Events; ++e)
+            os << (e ? "," : "") << '"' << name(Event(e)) << "\":" << count(Event(e));
+        os << "},\"ops\":{";
+        for (int op = 0; op < Ops; ++op)
+        {
+            std::uint64_t c = opCalls(Op(op)), ns = opNanos(Op(op));
+            os << (op ? "," : "") << '"' << name(Op(op)) << "\":{\"calls\":" << c
+               << ",\"total_ns\":" << ns << ",\"avg_ns\":" << (c ? ns / c : 0) << '}';
+        }
+        os << "}}";
+        return os.str();
+    }
+
+    static const char *name(Event e)
+    {
+        static const char *const names[Events] = {"compares", "clones", "destroys", "node_allocs", "node_frees"};
+        return names[e];
+    }
+    static const char *name(Op op)
+    {
+        static const char *const names[Ops] = {"insert", "search", "remove", "balance"};
+        return names[op];
+    }
+
+private:
+#ifdef TREE_STATS
+    mutable std::atomic<std::uint64_t> events[Events];
+    mutable std::atomic<std::uint64_t> calls[Ops];
+    mutable std::atomic<std::uint64_t> nanos[Ops];
+#endif
+};
@@ -0,0 +1,1374 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "ThreadPool.h"
+#include "TreeEngine.h"
+
+// Iterative building blocks shared by BinaryTree and TypedBinaryTree. Nothing
+// here recurses but the forked top levels of a set operation, so a degenerate
+// tree a million levels deep costs heap, not call stack. Node is any type with
+// left and right pointers.
+
+// Root-to-node path with the side taken below each entry. The first 64
+// entries live inline, so walks over balanced trees never allocate.
+template <class Node>
+class PathStack
+{
+public:
+    struct Step
+    {
+        Node *node;
+        bool left; // the path continues through node->left
+    };
+
+    PathStack() : n(0) {}
+    PathStack(const PathStack &) = delete;
+    PathStack &operator=(const PathStack &) = delete;
+
+    bool empty() const { return n == 0; }
+    void push(Node *node, bool left)
+    {
+        if (n < inlineCap)
+            small[n] = {node, left};
+        else
+            big.push_back({node, left});
+        ++n;
+    }
+    Step pop()
+    {
+        --n;
+        if (n < inlineCap)
+            return small[n];
+        Step s = big.back();
+        big.pop_back();
+        return s;
+    }
+
+private:
+    static constexpr std::size_t inlineCap = 64;
+    Step small[inlineCap];
+    std::vector<Step> big;
+    std::size_t n;
+};
+
+template <class Node, class F>
+void inorderWalk(Node *root, F f)
+{
+    std::vector<Node *> st;
+    for (Node *cur = root; cur || !st.empty();)
+    {
+        while (cur)
+        {
+            st.push_back(cur);
+            cur = cur->left;
+        }
+        cur = st.back();
+        st.pop_back();
+        f(cur);
+        cur = cur->right;
+    }
+}
+
+template <class Node, class F>
+void preorderWalk(Node *root, F f)
+{
+    std::vector<Node *> st;
+    if (root)
+        st.push_back(root);
+    while (!st.empty())
+    {
+        Node *n = st.back();
+        st.pop_back();
+        f(n);
+        if (n->right)
+            st.push_back(n->right);
+        if (n->left)
+            st.push_back(n->left);
+    }
+}
+
+template <class Node, class F>
+void postorderWalk(Node *root, F f)
+{
+    std::vector<Node *> st;
+    Node *last = nullptr; // last node visited
+    for (Node *cur = root; cur || !st.empty();)
+    {
+        while (cur)
+        {
+            st.push_back(cur);
+            cur = cur->left;
+        }
+        Node *top = st.back();
+        if (top->right && top->right != last)
+            cur = top->right;
+        else
+        {
+            f(top);
+            last = top;
+            st.pop_back();
+        }
+    }
+}
+
+// {value}(left)[right], the toStringFormatted layout
+template <class Node, class Print>
+void formattedWalk(Node *root, std::ostream &os, Print print)
+{
+    // second: 0 before the node, 1 between its subtrees, 2 after them
+    std::vector<std::pair<Node *, int>> st;
+    if (root)
+        st.emplace_back(root, 0);
+    while (!st.empty())
+    {
+        auto &top = st.back();
+        Node *n = top.first;
+        if (top.second == 0)
+        {
+            os << '{';
+            print(n);
+            os << "}(";
+            top.second = 1;
+            if (n->left)
+                st.emplace_back(n->left, 0);
+        }
+        else if (top.second == 1)
+        {
+            os << ")[";
+            top.second = 2;
+            if (n->right)
+                st.emplace_back(n->right, 0);
+        }
+        else
+        {
+            os << ']';
+            st.pop_back();
+        }
+    }
+}
+
+// levels in the tree, 0 when empty
+template <class Node>
+int treeHeight(Node *root)
+{
+    int h = 0;
+    std::vector<std::pair<Node *, int>> st;
+    if (root)
+        st.emplace_back(root, 1);
+    while (!st.empty())
+    {
+        auto [n, d] = st.back();
+        st.pop_back();
+        if (d > h)
+            h = d;
+        if (n->left)
+            st.emplace_back(n->left, d + 1);
+        if (n->right)
+            st.emplace_back(n->right, d + 1);
+    }
+    return h;
+}
+
+// nodes per depth, root at 0
+template <class Node>
+std::vector<std::size_t> nodesPerDepth(Node *root)
+{
+    std::vector<std::size_t> hist;
+    std::vector<std::pair<Node *, std::size_t>> st;
+    if (root)
+        st.emplace_back(root, 0);
+    while (!st.empty())
+    {
+        auto [n, d] = st.back();
+        st.pop_back();
+        if (hist.size() <= d)
+            hist.resize(d + 1);
+        ++hist[d];
+        if (n->left)
+            st.emplace_back(n->left, d + 1);
+        if (n->right)
+            st.emplace_back(n->right, d + 1);
+    }
+    return hist;
+}
+
+// Links n nodes, taken in order from next(), into the shape where the root of
+// positions [lo, hi) is (lo + hi - 1) / 2, and calls refresh on each node once
+// its children are linked. The stack holds one frame per level, log2(n) + 1.
+template <class Node, class Next, class Refresh>
+Node *buildBalanced(std::size_t n, Next next, Refresh refresh)
+{
+    struct Frame
+    {
+        std::size_t n;
+        Node *nd; // taken from next() once the left part is built
+    };
+    Frame st[66];
+    int top = 0;
+    st[0] = {n, nullptr};
+    Node *done = nullptr; // the subtree finished last
+    bool down = true;     // entering st[top] rather than returning to it
+    while (top >= 0)
+    {
+        Frame &f = st[top];
+        if (down)
+        {
+            if (f.n)
+                st[++top] = {(f.n - 1) / 2, nullptr};
+            else
+            {
+                done = nullptr;
+                --top;
+                down = false;
+            }
+        }
+        else if (!f.nd)
+        {
+            f.nd = next();
+            f.nd->left = done;
+            st[++top] = {f.n - 1 - (f.n - 1) / 2, nullptr};
+            down = true;
+        }
+        else
+        {
+            f.nd->right = done;
+            refresh(f.nd);
+            done = f.nd;
+            --top;
+        }
+    }
+    return done;
+}
+
+// Right rotations until every node hangs off the previous one's right;
+// returns the smallest. The tree's nodes are relinked, not copied.
+template <class Node>
+Node *treeToVine(Node *nd)
+{
+    Node *head = nullptr, **link = &head;
+    while (nd)
+    {
+        if (!nd->left)
+        {
+            *link = nd;
+            link = &nd->right;
+            nd = nd->right;
+        }
+        else
+        {
+            Node *l = nd->left;
+            nd->left = l->right;
+            l->right = nd;
+            nd = l;
+        }
+    }
+    return head;
+}
+// the first n nodes of the vine at head, relinked by buildBalanced
+template <class Node, class Refresh>
+Node *buildFromVine(Node *&head, std::size_t n, Refresh refresh)
+{
+    return buildBalanced<Node>(n, [&]
+                               {
+        Node *nd = head;
+        head = head->right;
+        return nd; }, refresh);
+}
+
+// Links nodes read in preorder (or postorder, with post) into the tree they
+// came from; cmp(a, b) orders two nodes three-way. Preorder: a smaller value
+// is the left child of the previous node, a larger one the right child of the
+// last ancestor it exceeds. Postorder read backwards is the mirror image
+// (root, right, left). False if nodes is not such a traversal.
+template <class Node, class Compare>
+bool buildFromTraversal(const std::vector<Node *> &nodes, bool post, Node *&root, Compare cmp)
+{
+    Node *Node::*nearSide = post ? &Node::right : &Node::left;
+    Node *Node::*farSide = post ? &Node::left : &Node::right;
+    int sign = post ? -1 : 1;
+    std::vector<Node *> st;
+    Node *bound = nullptr;
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        Node *n = nodes[post ? nodes.size() - 1 - i : i];
+        if (st.empty())
+        {
+            root = n;
+            st.push_back(n);
+            continue;
+        }
+        if (bound && sign * cmp(n, bound) <= 0)
+            return false;
+        int c = sign * cmp(n, st.back());
+        if (c < 0)
+            st.back()->*nearSide = n;
+        else
+        {
+            Node *parent = nullptr;
+            while (!st.empty() && (c = sign * cmp(n, st.back())) > 0)
+            {
+                parent = st.back();
+                st.pop_back();
+            }
+            if (c == 0)
+                return false;
+            parent->*farSide = n;
+            bound = parent;
+        }
+        st.push_back(n);
+    }
+    return true;
+}
+
+// Sorts nodes by cmp and hands all but the first of equal ones to drop.
+template <class Node, class Compare, class Drop>
+void sortUnique(std::vector<Node *> &nodes, Compare cmp, Drop drop)
+{
+    std::stable_sort(nodes.begin(), nodes.end(), [&](Node *a, Node *b)
+                     { return cmp(a, b) < 0; });
+    std::size_t w = 0;
+    for (Node *n : nodes)
+    {
+        if (w && cmp(nodes[w - 1], n) == 0)
+            drop(n);
+        else
+            nodes[w++] = n;
+    }
+    nodes.resize(w);
+}
+
+// Calls refresh on every node bottom-up (heights, and whatever else the
+// engine keeps); false if some node then breaks the AVL bound.
+template <class Node, class Refresh>
+bool refreshBottomUp(Node *nd, Refresh refresh)
+{
+    std::vector<Node *> st, order;
+    if (nd)
+        st.push_back(nd);
+    while (!st.empty())
+    {
+        Node *n = st.back();
+        st.pop_back();
+        order.push_back(n);
+        if (n->left)
+            st.push_back(n->left);
+        if (n->right)
+            st.push_back(n->right);
+    }
+    auto height = [](Node *n)
+    { return n ? static_cast<int>(n->height) : 0; };
+    bool ok = true;
+    for (auto it = order.rbegin(); it != order.rend(); ++it)
+    {
+        refresh(*it);
+        int bf = height((*it)->left) - height((*it)->right);
+        if (bf > 1 || bf < -1)
+            ok = false;
+    }
+    return ok;
+}
+
+// the printTree diagram: one line of values per level, then the links below
+template <class Node, class Print>
+void printLevels(Node *root, std::ostream &os, Print print)
+{
+    if (!root)
+    {
+        os << "(empty)\n";
+        return;
+    }
+    os << "\n";
+
+    std::vector<Node *> curr{root}, next;
+    int height = treeHeight(root);
+    int maxWidth = (1 << height) - 1;
+
+    int level = 0;
+    while (!curr.empty() && level < height)
+    {
+        int nodes = curr.size();
+        int spacing = maxWidth / nodes;
+
+        for (int i = 0; i < nodes; ++i)
+        {
+            os << std::string(spacing / 2, ' ');
+            if (curr[i])
+            {
+                print(curr[i]);
+                next.push_back(curr[i]->left);
+                next.push_back(curr[i]->right);
+            }
+            else
+            {
+                os << " ";
+                next.push_back(nullptr);
+                next.push_back(nullptr);
+            }
+            os << std::string(spacing - spacing / 2, ' ');
+        }
+        os << "\n";
+
+        bool anyChild = false;
+        for (auto n : next)
+            if (n)
+            {
+                anyChild = true;
+                break;
+            }
+        if (!anyChild)
+            break;
+
+        int conSpacing = spacing;
+        for (std::size_t i = 0; i + 1 < next.size(); i += 2)
+        {
+            os << std::string(conSpacing / 2 - 1, ' ');
+            os << (next[i] ? '/' : ' ');
+            os << std::string(2, ' ');
+            os << (next[i + 1] ? '\\' : ' ');
+            os << std::string(conSpacing - conSpacing / 2 - 1, ' ');
+        }
+        os << "\n";
+
+        curr.swap(next);
+        next.clear();
+        ++level;
+    }
+    os << "\n";
+}
+
+// calls f(k) for the slots of an n-element Eytzinger array in sorted order
+template <class F>
+void eytzingerInorder(std::size_t n, F f)
+{
+    if (!n)
+        return;
+    std::size_t k = 0;
+    while (2 * k + 1 < n)
+        k = 2 * k + 1;
+    for (;;)
+    {
+        f(k);
+        if (2 * k + 2 < n)
+        {
+            k = 2 * k + 2;
+            while (2 * k + 1 < n)
+                k = 2 * k + 1;
+            continue;
+        }
+        // climb past the ancestors whose right subtree is finished
+        while (k && k % 2 == 0)
+            k = (k - 1) / 2;
+        if (!k)
+            return;
+        k = (k - 1) / 2;
+    }
+}
+
+// An in-order position kept as the path from the root, empty past either
+// end. inorderStep(path, root, &Node::right, &Node::left) moves to the next
+// value, and from the end wraps around to the first; swapping the sides
+// moves back. Amortized O(1) per step.
+template <class Node>
+void inorderDescend(std::vector<Node *> &path, Node *nd, Node *Node::*side)
+{
+    for (; nd; nd = nd->*side)
+        path.push_back(nd);
+}
+template <class Node>
+void inorderStep(std::vector<Node *> &path, Node *root, Node *Node::*fwd, Node *Node::*back)
+{
+    if (path.empty())
+        return inorderDescend(path, root, back);
+    Node *nd = path.back();
+    if (nd->*fwd)
+        return inorderDescend(path, nd->*fwd, back);
+    // climb while coming up from the fwd side
+    path.pop_back();
+    while (!path.empty() && path.back()->*fwd == nd)
+    {
+        nd = path.back();
+        path.pop_back();
+    }
+}
+
+// The search-tree algorithms of BinaryTree and TypedBinaryTree, written once
+// against what the engine provides; Tree declares friend struct TreeCore<Tree>.
+//   Node: left, right, size, refs, hash (24 bits), height (8 bits)
+//   Tree: type, root, count, pol, sized, forking, Probe, probe(value or node),
+//         compare(probe, node), value(node) as void *, newNode(node->data),
+//         rawCopy(void *), parsedNode(token), own, release, freeNode,
+//         takeValue(dst, src), link(path, node), sharedCopy(node, n), blank(),
+//         clear, thaw, sharing, balance, insertRaw
+// own(nd) returns nd, or a private copy when others still link it; release
+// drops the caller's link to an unlinked node; link puts a new node in at the
+// end of its search path (Splay climbs, everything else relinks the path).
+template <class Tree>
+struct TreeCore
+{
+    using Node = typename Tree::Node;
+    using Probe = typename Tree::Probe;
+
+    enum class SetOp
+    {
+        Union,
+        Intersect,
+        Difference
+    };
+    static constexpr std::size_t forkCutoff = 1 << 15;
+    static constexpr unsigned nullHash = 0x9e3779b9u;
+
+    static int height(const Node *nd) { return nd ? nd->height : 0; }
+    static std::size_t sizeOf(const Node *nd) { return nd ? nd->size : 0; }
+
+    static void refresh(const Tree &t, Node *nd)
+    {
+        nd->height = 1 + std::max(height(nd->left), height(nd->right));
+        nd->hash = 0;
+        if (t.sized)
+            nd->size = static_cast<unsigned>(1 + sizeOf(nd->left) + sizeOf(nd->right));
+    }
+    static Node *rotateLeft(Tree &t, Node *nd)
+    {
+        nd = t.own(nd);
+        Node *r = t.own(nd->right);
+        nd->right = r->left;
+        r->left = nd;
+        refresh(t, nd);
+        refresh(t, r);
+        return r;
+    }
+    static Node *rotateRight(Tree &t, Node *nd)
+    {
+        nd = t.own(nd);
+        Node *l = t.own(nd->left);
+        nd->left = l->right;
+        l->right = nd;
+        refresh(t, nd);
+        refresh(t, l);
+        return l;
+    }
+    // nd's children changed: AVL restores the bound, the other policies
+    // only keep sizes and hashes current
+    static Node *rebalance(Tree &t, Node *nd)
+    {
+        if (t.pol != BalancePolicy::AVL)
+        {
+            if (t.sized)
+                refresh(t, nd);
+            else if (nd->hash) // stays 0 until hashed, so most paths see no stores
+                nd->hash = 0;
+            return nd;
+        }
+        refresh(t, nd);
+        int bf = height(nd->left) - height(nd->right);
+        if (bf > 1)
+        {
+            if (height(nd->left->left) < height(nd->left->right))
+                nd->left = rotateLeft(t, nd->left);
+            return rotateRight(t, nd);
+        }
+        if (bf < -1)
+        {
+            if (height(nd->right->right) < height(nd->right->left))
+                nd->right = rotateRight(t, nd->right);
+            return rotateLeft(t, nd);
+        }
+        return nd;
+    }
+    // Links child where the path ends and works back up to the top of the
+    // path: each node is owned, relinked and rebalanced. Returns the new top.
+    static Node *relinkPath(Tree &t, PathStack<Node> &path, Node *child)
+    {
+        while (!path.empty())
+        {
+            auto step = path.pop();
+            Node *nd = t.own(step.node);
+            (step.left ? nd->left : nd->right) = child;
+            child = rebalance(t, nd);
+        }
+        return child;
+    }
+
+    static Node *find(const Tree &t, Node *nd, const Probe &k)
+    {
+        while (nd)
+        {
+            int c = t.compare(k, nd);
+            if (c == 0)
+                return nd;
+            nd = (c < 0 ? nd->left : nd->right);
+        }
+        return nullptr;
+    }
+    // Links make()'s node where k belongs; false, without calling make, when
+    // k is already there.
+    template <class Make>
+    static bool insert(Tree &t, const Probe &k, Make make)
+    {
+        PathStack<Node> path;
+        for (Node *nd = t.root; nd;)
+        {
+            int c = t.compare(k, nd);
+            if (c == 0)
+                return false;
+            path.push(nd, c < 0);
+            nd = (c < 0 ? nd->left : nd->right);
+        }
+        t.count++;
+        t.link(path, make());
+        return true;
+    }
+    static bool remove(Tree &t, const Probe &k)
+    {
+        PathStack<Node> path;
+        Node *nd = t.root;
+        while (nd)
+        {
+            int c = t.compare(k, nd);
+            if (c == 0)
+                break;
+            path.push(nd, c < 0);
+            nd = (c < 0 ? nd->left : nd->right);
+        }
+        if (!nd)
+            return false;
+        Node *repl;
+        if (!nd->left || !nd->right)
+        {
+            repl = nd->left ? nd->left : nd->right;
+            t.release(nd);
+        }
+        else
+        {
+            // the successor node is unlinked and takes the removed value with it
+            Node *m = nullptr;
+            Node *right = detachMin(t, nd->right, m);
+            nd = t.own(nd);
+            nd->right = right;
+            t.takeValue(nd, m);
+            t.release(m);
+            repl = rebalance(t, nd);
+        }
+        t.root = relinkPath(t, path, repl);
+        t.count--;
+        return true;
+    }
+    static Node *detachMin(Tree &t, Node *nd, Node *&min)
+    {
+        PathStack<Node> path;
+        for (; nd->left; nd = nd->left)
+            path.push(nd, true);
+        min = nd;
+        return relinkPath(t, path, nd->right);
+    }
+
+    // Copies the shared nodes on the search path for k, and on to its
+    // successor, top-down: a node's count is exact only once its ancestors
+    // are private, which the bottom-up updates rely on.
+    static void unsharePath(Tree &t, const Probe &k)
+    {
+        Node **link = &t.root;
+        while (*link)
+        {
+            *link = t.own(*link);
+            int c = t.compare(k, *link);
+            if (c == 0)
+            {
+                for (link = &(*link)->right; *link; link = &(*link)->left)
+                    *link = t.own(*link);
+                return;
+            }
+            link = c < 0 ? &(*link)->left : &(*link)->right;
+        }
+    }
+    static Node *ownAll(Tree &t, Node *nd)
+    {
+        std::vector<Node **> st{&nd};
+        while (!st.empty())
+        {
+            Node **link = st.back();
+            st.pop_back();
+            if (!*link)
+                continue;
+            *link = t.own(*link);
+            st.push_back(&(*link)->left);
+            st.push_back(&(*link)->right);
+        }
+        return nd;
+    }
+    // drops one link to nd, freeing whatever is no longer linked at all
+    static void dropRef(Tree &t, Node *nd)
+    {
+        std::vector<Node *> st;
+        if (nd)
+            st.push_back(nd);
+        while (!st.empty())
+        {
+            Node *n = st.back();
+            st.pop_back();
+            if (--n->refs)
+                continue;
+            if (n->left)
+                st.push_back(n->left);
+            if (n->right)
+                st.push_back(n->right);
+            t.freeNode(n);
+        }
+    }
+    static std::size_t countNodes(const Node *nd)
+    {
+        std::size_t n = 0;
+        std::vector<const Node *> st;
+        if (nd)
+            st.push_back(nd);
+        for (; !st.empty(); ++n)
+        {
+            const Node *c = st.back();
+            st.pop_back();
+            if (c->left)
+                st.push_back(c->left);
+            if (c->right)
+                st.push_back(c->right);
+        }
+        return n;
+    }
+
+    // PRE/POST rebuild the exact shape with a stack; IN, or strictly
+    // ascending input under any other order, builds a balanced tree; all in
+    // O(n). Input that is not a valid traversal is inserted node by node.
+    static void bulkLoad(Tree &t, std::vector<Node *> &nodes, const std::string &order)
+    {
+        auto cmp = [&t](Node *a, Node *b)
+        { return t.compare(t.probe(a), b); };
+        bool shaped = order == "PRE" || order == "POST";
+        if (shaped && buildFromTraversal(nodes, order == "POST", t.root, cmp))
+        {
+            t.count = nodes.size();
+            bool avl = refreshBottomUp(t.root, [&t](Node *nd)
+                                       { refresh(t, nd); });
+            if (!avl && t.pol == BalancePolicy::AVL)
+                t.balance();
+            return;
+        }
+        bool sorted = !shaped;
+        for (std::size_t i = 1; i < nodes.size() && sorted; ++i)
+            sorted = cmp(nodes[i - 1], nodes[i]) < 0;
+        if (!sorted && order == "IN")
+        {
+            sortUnique(nodes, cmp, [&t](Node *n)
+                       { t.freeNode(n); });
+            sorted = true;
+        }
+        if (sorted)
+        {
+            t.root = buildSorted(t, nodes);
+            t.count = nodes.size();
+            return;
+        }
+        t.root = nullptr;
+        for (Node *n : nodes)
+        {
+            n->left = n->right = nullptr;
+            n->size = 1;
+            n->height = 1;
+            if (!insert(t, t.probe(n), [n]
+                        { return n; }))
+                t.freeNode(n);
+        }
+    }
+    static Node *buildSorted(const Tree &t, const std::vector<Node *> &nodes)
+    {
+        std::size_t i = 0;
+        return buildBalanced<Node>(nodes.size(), [&]
+                                   { return nodes[i++]; }, [&t](Node *nd)
+                                   { refresh(t, nd); });
+    }
+    static void loadTraversal(Tree &t, const std::string &str, const std::string &order)
+    {
+        t.clear();
+        std::vector<Node *> nodes;
+        std::istringstream iss(str);
+        std::string tok;
+        while (iss >> tok)
+            nodes.push_back(t.parsedNode(tok));
+        bulkLoad(t, nodes, order);
+    }
+    static void loadFormatted(Tree &t, const std::string &str)
+    {
+        t.clear();
+        // braces appear in preorder, which pins down the shape
+        std::vector<Node *> nodes;
+        for (std::size_t i = 0; i < str.size(); ++i)
+        {
+            if (str[i] == '{')
+            {
+                std::size_t j = str.find('}', i);
+                if (j == std::string::npos)
+                    break;
+                nodes.push_back(t.parsedNode(std::string_view(str).substr(i + 1, j - (i + 1))));
+                i = j;
+            }
+        }
+        bulkLoad(t, nodes, "PRE");
+    }
+    // copies of n values, bulk loaded in the given order
+    static void loadCopies(Tree &t, void *const *values, std::size_t n, const std::string &order)
+    {
+        t.clear();
+        std::vector<Node *> nodes;
+        nodes.reserve(n);
+        for (std::size_t i = 0; i < n; ++i)
+            nodes.push_back(t.rawCopy(values[i]));
+        bulkLoad(t, nodes, order);
+    }
+    // owned: every value in the list is the load's to free, and the ones
+    // that become nodes are moved in with insertOwned
+    static bool loadPairs(Tree &t, const std::vector<std::pair<void *, void *>> &list, bool owned)
+    {
+        t.clear();
+        std::size_t rootAt = list.size();
+        for (std::size_t i = 0; i < list.size(); ++i)
+            if (list[i].second == nullptr)
+            {
+                rootAt = i;
+                break;
+            }
+        bool ok = list.empty() || rootAt < list.size();
+        auto put = [&](void *v)
+        { owned ? t.insertOwned(v) : t.insertRaw(v); };
+        if (rootAt < list.size())
+            put(list[rootAt].first);
+        for (std::size_t i = 0; i < list.size(); ++i)
+        {
+            auto &pr = list[i];
+            if (ok && pr.second)
+                put(pr.first);
+            else if (owned && i != rootAt)
+                t.type->destroy(pr.first);
+            if (owned && pr.second)
+                t.type->destroy(pr.second);
+        }
+        return ok;
+    }
+
+    // (value, parent value) in BFS order, the root's parent nullptr
+    static std::vector<std::pair<void *, void *>> pairList(const Tree &t)
+    {
+        std::vector<std::pair<void *, void *>> out;
+        if (!t.root)
+            return out;
+        std::queue<std::pair<Node *, void *>> q;
+        q.push({t.root, nullptr});
+        while (!q.empty())
+        {
+            auto [n, parent] = q.front();
+            q.pop();
+            out.emplace_back(Tree::value(n), parent);
+            if (n->left)
+                q.push({n->left, Tree::value(n)});
+            if (n->right)
+                q.push({n->right, Tree::value(n)});
+        }
+        return out;
+    }
+    static std::vector<void *> preorderList(const Tree &t)
+    {
+        std::vector<void *> out;
+        out.reserve(t.count);
+        preorderWalk(t.root, [&](Node *n)
+                     { out.push_back(Tree::value(n)); });
+        return out;
+    }
+    static void *nodeAt(const Tree &t, const std::string &path)
+    {
+        Node *cur = t.root;
+        for (char c : path)
+        {
+            if (!cur)
+                return nullptr;
+            if (c == 'L' || c == 'l')
+                cur = cur->left;
+            else if (c == 'R' || c == 'r' || c == 'P' || c == 'p')
+                cur = cur->right;
+        }
+        return cur ? Tree::value(cur) : nullptr;
+    }
+
+    // Order statistics: O(log n) once t.sized, otherwise a walk from the
+    // smallest value.
+    static void enableOrderStatistics(Tree &t)
+    {
+        if (t.sized)
+            return;
+        t.sized = true;
+        refreshBottomUp(t.root, [&t](Node *nd)
+                        { refresh(t, nd); });
+    }
+    // the path to the first value >= k (> k with upper), empty if none
+    static std::vector<Node *> boundPath(const Tree &t, const Probe &k, bool upper)
+    {
+        std::vector<Node *> path;
+        std::size_t keep = 0;
+        for (Node *cur = t.root; cur;)
+        {
+            path.push_back(cur);
+            int c = t.compare(k, cur);
+            if (c > 0 || (c == 0 && upper))
+            {
+                cur = cur->right;
+                continue;
+            }
+            keep = path.size();
+            if (c == 0)
+                break;
+            cur = cur->left;
+        }
+        path.resize(keep);
+        return path;
+    }
+    // values < k, or <= k when inclusive
+    static std::size_t countBelow(const Tree &t, const Probe &k, bool inclusive)
+    {
+        if (!t.sized)
+        {
+            std::vector<Node *> stop = boundPath(t, k, inclusive), path;
+            Node *end = stop.empty() ? nullptr : stop.back();
+            std::size_t r = 0;
+            for (inorderDescend(path, t.root, &Node::left); !path.empty() && path.back() != end; ++r)
+                inorderStep(path, t.root, &Node::right, &Node::left);
+            return r;
+        }
+        std::size_t r = 0;
+        for (Node *cur = t.root; cur;)
+        {
+            int c = t.compare(k, cur);
+            if (c < 0 || (c == 0 && !inclusive))
+            {
+                if (c == 0)
+                    return r + sizeOf(cur->left);
+                cur = cur->left;
+            }
+            else
+            {
+                r += sizeOf(cur->left) + 1;
+                if (c == 0)
+                    return r;
+                cur = cur->right;
+            }
+        }
+        return r;
+    }
+    static std::size_t countRange(const Tree &t, const Probe &lo, const Probe &hi)
+    {
+        // lo > hi leaves no more values <= hi than there are < lo
+        std::size_t below = countBelow(t, lo, false), upTo = countBelow(t, hi, true);
+        return upTo > below ? upTo - below : 0;
+    }
+    static void *select(const Tree &t, std::size_t k)
+    {
+        if (k >= t.count)
+            return nullptr;
+        if (!t.sized)
+        {
+            std::vector<Node *> path;
+            inorderDescend(path, t.root, &Node::left);
+            while (k--)
+                inorderStep(path, t.root, &Node::right, &Node::left);
+            return Tree::value(path.back());
+        }
+        Node *cur = t.root;
+        for (;;)
+        {
+            std::size_t l = sizeOf(cur->left);
+            if (k == l)
+                return Tree::value(cur);
+            if (k < l)
+                cur = cur->left;
+            else
+            {
+                k -= l + 1;
+                cur = cur->right;
+            }
+        }
+    }
+    // calls f(value) for the values in [lo, hi] in order until f returns
+    // false; returns how many f saw
+    template <class F>
+    static std::size_t range(const Tree &t, const Probe &lo, const Probe &hi, F f)
+    {
+        std::size_t k = 0;
+        std::vector<Node *> path = boundPath(t, lo, false);
+        for (; !path.empty() && t.compare(hi, path.back()) >= 0; inorderStep(path, t.root, &Node::right, &Node::left))
+        {
+            ++k;
+            if (!f(Tree::value(path.back())))
+                break;
+        }
+        return k;
+    }
+
+    // Copy of the subtree at k, nullptr if k is absent. With share it links
+    // t's nodes in O(1) (O(k) to count them without order statistics).
+    static Tree *subtree(const Tree &t, const Probe &k, bool share)
+    {
+        Node *nd = find(t, t.root, k);
+        if (!nd)
+            return nullptr;
+        if (share)
+            return t.sharedCopy(nd, t.sized ? nd->size : countNodes(nd));
+        return copy(t, nd);
+    }
+    // node for node copy of the subtree at nd into a tree of its own
+    static Tree *copy(const Tree &t, Node *nd)
+    {
+        Tree *out = t.blank();
+        std::size_t n = 0;
+        out->root = copyStructure(*out, nd, n);
+        out->count = n;
+        out->sized = t.sized;
+        return out;
+    }
+    // preorder copy of src's subtree into t's storage; n gets the count
+    static Node *copyStructure(Tree &t, Node *src, std::size_t &n)
+    {
+        Node *out = nullptr;
+        std::vector<std::pair<Node *, Node **>> st;
+        if (src)
+            st.emplace_back(src, &out);
+        while (!st.empty())
+        {
+            auto [s, link] = st.back();
+            st.pop_back();
+            Node *d = t.newNode(s->data);
+            d->size = s->size;
+            d->hash = s->hash;
+            d->height = s->height;
+            *link = d;
+            ++n;
+            if (s->right)
+                st.emplace_back(s->right, &d->right);
+            if (s->left)
+                st.emplace_back(s->left, &d->left);
+        }
+        return out;
+    }
+    // other itself when it is a Tree, otherwise a same-shape copy of it in hold
+    static const Tree &sameEngine(const Tree &t, const TreeEngine &other, std::unique_ptr<Tree> &hold)
+    {
+        if (auto *o = dynamic_cast<const Tree *>(&other))
+            return *o;
+        hold.reset(t.blank());
+        std::vector<void *> pre = other.toPreorderList();
+        loadCopies(*hold, pre.data(), pre.size(), "PRE");
+        return *hold;
+    }
+
+    // Merkle hashes compared first, then node by node on a match. Stale
+    // hashes (0) are filled in bottom-up; fresh subtrees are not entered.
+    static unsigned subtreeHash(const Tree &t, Node *nd)
+    {
+        if (!nd)
+            return nullHash;
+        std::vector<Node *> st{nd};
+        while (!st.empty())
+        {
+            Node *n = st.back();
+            if (n->hash)
+            {
+                st.pop_back();
+                continue;
+            }
+            bool ready = true;
+            for (Node *c : {n->left, n->right})
+                if (c && !c->hash)
+                {
+                    st.push_back(c);
+                    ready = false;
+                }
+            if (!ready)
+                continue;
+            st.pop_back();
+            std::uint64_t h = t.type->hash(Tree::value(n));
+            h = (h ^ (n->left ? n->left->hash : nullHash)) * 0x9e3779b97f4a7c15ull;
+            h ^= h >> 32;
+            h = (h ^ (n->right ? n->right->hash : nullHash)) * 0xc2b2ae3d27d4eb4full;
+            h ^= h >> 29;
+            n->hash = static_cast<unsigned>(h ^ (h >> 32)) & 0xffffff;
+            if (!n->hash)
+                n->hash = 1;
+        }
+        return nd->hash;
+    }
+    static bool sameShape(const Tree &t, Node *a, Node *b)
+    {
+        std::vector<std::pair<Node *, Node *>> st{{a, b}};
+        while (!st.empty())
+        {
+            auto [x, y] = st.back();
+            st.pop_back();
+            if (!x || !y)
+            {
+                if (x != y)
+                    return false;
+                continue;
+            }
+            if (t.compare(t.probe(x), y) != 0)
+                return false;
+            st.emplace_back(x->left, y->left);
+            st.emplace_back(x->right, y->right);
+        }
+        return true;
+    }
+    static bool containsSubtree(const Tree &t, const Tree &sub)
+    {
+        if (!sub.root)
+            return true;
+        // values are unique, so only the node equal to sub's root can match
+        Node *nd = find(t, t.root, t.probe(sub.root));
+        if (!nd || subtreeHash(t, nd) != subtreeHash(sub, sub.root))
+            return false;
+        return sameShape(t, nd, sub.root);
+    }
+    static bool equals(const Tree &t, const Tree &other)
+    {
+        if (t.count != other.count || subtreeHash(t, t.root) != subtreeHash(other, other.root))
+            return false;
+        return sameShape(t, t.root, other.root);
+    }
+
+    // Split/join set operations; other is only read and on equal keys the
+    // value already in t is kept. Large inputs fork the two recursive halves
+    // onto ThreadPool::instance(), about two tasks per thread.
+    static void setOp(Tree &t, SetOp op, const Tree &other)
+    {
+        if (&other == &t)
+        {
+            if (op == SetOp::Difference)
+                t.clear();
+            return;
+        }
+        t.thaw();
+        if (t.sharing())
+            t.root = ownAll(t, t.root);
+        int forks = 0;
+        unsigned threads = ThreadPool::instance().size();
+        if (threads && t.count + other.count >= forkCutoff)
+            for (unsigned n = threads + 1; n; n >>= 1)
+                ++forks;
+        t.forking = forks > 0;
+        long delta = 0;
+        t.root = setOpRec(t, op, t.root, other.root, delta, forks);
+        t.forking = false;
+        t.count += delta;
+    }
+    // Splits a by the root of b and recurses on the matching halves. Only
+    // the forked top levels recurse; setOpSeq does the rest with its own stack.
+    static Node *setOpRec(Tree &t, SetOp op, Node *a, const Node *b, long &delta, int forks)
+    {
+        if (forks <= 0)
+            return setOpSeq(t, op, a, b, delta);
+        if (!b)
+        {
+            if (op == SetOp::Intersect)
+                dropRec(t, a, delta);
+            return op == SetOp::Intersect ? nullptr : a;
+        }
+        if (!a)
+            return op == SetOp::Union ? copyBalanced(t, b, delta) : nullptr;
+        Node *l, *r;
+        Node *m = splitAt(t, op, a, b, l, r, delta);
+        long dl = 0, dr = 0;
+        ThreadPool::instance().invoke([&]
+                                      { l = setOpRec(t, op, l, b->left, dl, forks - 1); },
+                                      [&]
+                                      { r = setOpRec(t, op, r, b->right, dr, forks - 1); });
+        delta += dl + dr;
+        return m ? join(t, l, m, r) : join2(t, l, r);
+    }
+    // setOpRec without forking, as a loop over explicit frames
+    static Node *setOpSeq(Tree &t, SetOp op, Node *a, const Node *b, long &delta)
+    {
+        struct Frame
+        {
+            const Node *b;
+            Node *l, *r, *m;
+            bool leftDone;
+        };
+        std::vector<Frame> st;
+        Node *ret = nullptr;
+        bool calling = true; // a and b are the arguments of a pending call
+        for (;;)
+        {
+            if (calling)
+            {
+                calling = false;
+                if (!b)
+                {
+                    if (op == SetOp::Intersect)
+                        dropRec(t, a, delta);
+                    ret = op == SetOp::Intersect ? nullptr : a;
+                }
+                else if (!a)
+                    ret = op == SetOp::Union ? copyBalanced(t, b, delta) : nullptr;
+                else
+                {
+                    Frame f{b, nullptr, nullptr, nullptr, false};
+                    f.m = splitAt(t, op, a, b, f.l, f.r, delta);
+                    st.push_back(f);
+                    a = f.l;
+                    b = b->left;
+                    calling = true;
+                    continue;
+                }
+            }
+            if (st.empty())
+                return ret;
+            Frame &f = st.back();
+            if (!f.leftDone)
+            {
+                f.l = ret;
+                f.leftDone = true;
+                a = f.r;
+                b = f.b->right;
+                calling = true;
+                continue;
+            }
+            ret = f.m ? join(t, f.l, f.m, ret) : join2(t, f.l, ret);
+            st.pop_back();
+        }
+    }
+    // splits a by b's value; returns the node the result keeps there, if any
+    static Node *splitAt(Tree &t, SetOp op, Node *a, const Node *b, Node *&l, Node *&r, long &delta)
+    {
+        Node *m = split(t, a, t.probe(b), l, r);
+        if (m && op == SetOp::Difference)
+        {
+            t.release(m);
+            --delta;
+            m = nullptr;
+        }
+        else if (!m && op == SetOp::Union)
+        {
+            m = t.newNode(b->data);
+            ++delta;
+        }
+        return m;
+    }
+    // Links l < mid < r. Under AVL mid goes down the spine of the taller
+    // side to where the heights differ by at most one, rebalancing on the
+    // way up.
+    static Node *join(Tree &t, Node *l, Node *mid, Node *r)
+    {
+        PathStack<Node> path;
+        while (t.pol == BalancePolicy::AVL)
+        {
+            int hl = height(l), hr = height(r);
+            if (hl > hr + 1)
+            {
+                l = t.own(l);
+                path.push(l, false);
+                l = l->right;
+            }
+            else if (hr > hl + 1)
+            {
+                r = t.own(r);
+                path.push(r, true);
+                r = r->left;
+            }
+            else
+                break;
+        }
+        mid = t.own(mid);
+        mid->left = l;
+        mid->right = r;
+        refresh(t, mid);
+        return relinkPath(t, path, mid);
+    }
+    static Node *join2(Tree &t, Node *l, Node *r)
+    {
+        if (!l)
+            return r;
+        if (!r)
+            return l;
+        Node *m = nullptr;
+        r = detachMin(t, r, m);
+        return join(t, l, m, r);
+    }
+    // Returns the node equal to k, unlinked (nullptr if absent); l and r get
+    // the smaller and the larger keys.
+    static Node *split(Tree &t, Node *nd, const Probe &k, Node *&l, Node *&r)
+    {
+        // walk down to k, then join the pieces back up level by level
+        PathStack<Node> path;
+        Node *m = nullptr;
+        l = r = nullptr;
+        while (nd)
+        {
+            int c = t.compare(k, nd);
+            if (c == 0)
+            {
+                l = nd->left;
+                r = nd->right;
+                m = nd;
+                break;
+            }
+            path.push(nd, c < 0);
+            nd = (c < 0 ? nd->left : nd->right);
+        }
+        while (!path.empty())
+        {
+            auto step = path.pop();
+            if (step.left)
+                r = join(t, r, step.node, step.node->right);
+            else
+                l = join(t, step.node->left, step.node, l);
+        }
+        return m;
+    }
+    // copies of b's values in a balanced shape, whatever b's own shape is
+    static Node *copyBalanced(Tree &t, const Node *b, long &delta)
+    {
+        std::vector<Node *> nodes;
+        std::vector<const Node *> st;
+        for (const Node *cur = b; cur || !st.empty();)
+        {
+            while (cur)
+            {
+                st.push_back(cur);
+                cur = cur->left;
+            }
+            cur = st.back();
+            st.pop_back();
+            nodes.push_back(t.newNode(cur->data));
+            cur = cur->right;
+        }
+        delta += static_cast<long>(nodes.size());
+        return buildSorted(t, nodes);
+    }
+    static void dropRec(Tree &t, Node *nd, long &delta)
+    {
+        std::vector<Node *> st;
+        if (nd)
+            st.push_back(nd);
+        while (!st.empty())
+        {
+            Node *n = st.back();
+            st.pop_back();
+            if (n->left)
+                st.push_back(n->left);
+            if (n->right)
+                st.push_back(n->right);
+            t.release(n);
+            --delta;
+        }
+    }
+};
@@ -0,0 +1,576 @@
+#pragma once
+#include <string>
+#include <sstream>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+#include <array>
+#include <memory>
+#include <mutex>
+#include "Types.h"
+#include "TreeEngine.h"
+#include "SlabPool.h"
+#include "BatchSearch.h"
+#include "TreeStats.h"
+#include "TreeWalk.h"
+
+// Three-way comparators with the same ordering as the matching Type::compare.
+// One that defines Key, key() and exactKey makes the tree cache key(value) in
+// every node, with the meaning of Type::key.
+template <class T>
+struct ThreeWayCompare
+{
+    int operator()(const T &x, const T &y) const { return x < y ? -1 : (y < x ? +1 : 0); }
+};
+
+struct DoubleCompare
+{
+    int operator()(double x, double y) const { return compareDoubles(x, y); }
+};
+
+struct ComplexCompare
+{
+    using Key = std::array<std::uint64_t, 3>; // (norm, real, imag)
+    static constexpr bool exactKey = true;
+    static Key key(const Complex &z) { return {orderedBits(std::norm(z)), orderedBits(z.real()), orderedBits(z.imag())}; }
+    int operator()(const Complex &A, const Complex &B) const
+    {
+        if (int c = compareDoubles(std::norm(A), std::norm(B)))
+            return c;
+        if (int c = compareDoubles(A.real(), B.real()))
+            return c;
+        return compareDoubles(A.imag(), B.imag());
+    }
+};
+
+struct StringCompare
+{
+    using Key = std::uint64_t;
+    static constexpr bool exactKey = false;
+    static Key key(const std::string &s) { return stringPrefix(s); }
+    int operator()(const std::string &x, const std::string &y) const
+    {
+        int c = x.compare(y);
+        return c < 0 ? -1 : (c > 0 ? +1 : 0);
+    }
+};
+
+template <class C, class = void>
+struct CachedKey
+{
+    static constexpr bool enabled = false;
+    struct type
+    {
+    };
+};
+template <class C>
+struct CachedKey<C, std::void_t<typename C::Key>>
+{
+    static constexpr bool enabled = true;
+    using type = typename C::Key;
+};
+template <class K>
+struct KeySlot
+{
+    K key;
+};
+struct NoKeySlot
+{
+};
+
+// Same operations as BinaryTree, but values are stored inline in the node and
+// compared through Compare without virtual calls. The Type is used only to
+// parse and print values, so output matches BinaryTree byte for byte. The
+// algorithms are TreeCore's; what is left here is storage. Trees that share
+// nodes (subtree with share, snapshot) share the pool and count links in refs.
+template <class T, class Compare = ThreeWayCompare<T>>
+class TypedBinaryTree : public TreeEngine
+{
+public:
+    static constexpr bool keyed = CachedKey<Compare>::enabled;
+    using Key = typename CachedKey<Compare>::type;
+    struct Node : std::conditional_t<keyed, KeySlot<Key>, NoKeySlot>
+    {
+        T data;
+        unsigned size; // next to data, where a 4-byte T leaves a hole
+        Node *left;
+        Node *right;
+        unsigned refs;
+        unsigned hash : 24;
+        unsigned height : 8;
+        Node(const T &d) : data(d), size(1), left(nullptr), right(nullptr), refs(1), hash(0), height(1) { cacheKey(); }
+        Node(T &&d) : data(std::move(d)), size(1), left(nullptr), right(nullptr), refs(1), hash(0), height(1) { cacheKey(); }
+        void cacheKey()
+        {
+            if constexpr (keyed)
+                this->key = Compare::key(data);
+        }
+    };
+
+    explicit TypedBinaryTree(Type *t, BalancePolicy p = BalancePolicy::None)
+        : type(t), root(nullptr), count(0), pol(p), sized(false),
+          pool(std::make_shared<SlabPool>(sizeof(Node))), frozen(false), forking(false) {}
+    ~TypedBinaryTree() { clear(); }
+    TypedBinaryTree(const TypedBinaryTree &) = delete;
+    TypedBinaryTree &operator=(const TypedBinaryTree &) = delete;
+
+    void clear() override
+    {
+        thaw();
+        if (sharing())
+        {
+            Core::dropRef(*this, root);
+            pool = std::make_shared<SlabPool>(pool->blockSize());
+        }
+        else
+        {
+            if (!std::is_trivially_destructible<T>::value)
+                destroyAll(root);
+            counters.add(TreeStats::NodeFrees, count);
+            pool->release();
+        }
+        root = nullptr;
+        count = 0;
+    }
+    size_t size() const { return count; }
+
+    bool insert(const T &d)
+    {
+        TreeStats::Timer tm(counters, TreeStats::Insert);
+        Probe k = probe(d);
+        if (sharing())
+            Core::unsharePath(*this, k);
+        bool ok = Core::insert(*this, k, [&]
+                               { return newNode(d); });
+        if (ok)
+            thaw();
+        return ok;
+    }
+    bool search(const T &key) const
+    {
+        TreeStats::Timer tm(counters, TreeStats::Search);
+        if (frozen)
+            return searchFrozen(key);
+        return Core::find(*this, root, probe(key)) != nullptr;
+    }
+    bool remove(const T &key)
+    {
+        TreeStats::Timer tm(counters, TreeStats::Remove);
+        Probe k = probe(key);
+        if (sharing())
+            Core::unsharePath(*this, k);
+        bool rem = Core::remove(*this, k);
+        if (rem)
+            thaw();
+        return rem;
+    }
+
+    bool insertRaw(void *d) override { return insert(*static_cast<T *>(d)); }
+    bool insertOwned(void *d) override
+    {
+        bool ok = insertMoved(std::move(*static_cast<T *>(d)));
+        type->destroy(d);
+        return ok;
+    }
+    bool emplaceFromString(std::string_view s) override
+    {
+        ParsedValue v(*type, s);
+        return insertMoved(std::move(*static_cast<T *>(v.get())));
+    }
+    bool searchRaw(void *key) const override { return search(*static_cast<T *>(key)); }
+    bool removeRaw(void *key) override { return remove(*static_cast<T *>(key)); }
+    void searchBatch(const void *keys, size_t n, bool *out) const override
+    {
+        const T *k = static_cast<const T *>(keys);
+        if constexpr (std::is_same<T, int>::value || std::is_same<T, double>::value)
+            if (frozen)
+                return eytzingerSearchBatch(eytz.data(), eytz.size(), k, n, out);
+        for (size_t i = 0; i < n; ++i)
+            out[i] = search(k[i]);
+    }
+
+    // relinks the nodes in place, same shape as BinaryTree::balance
+    void balance() override
+    {
+        TreeStats::Timer tm(counters, TreeStats::Balance);
+        if (sharing())
+            root = Core::ownAll(*this, root);
+        Node *head = treeToVine(root);
+        root = buildFromVine(head, count, [this](Node *nd)
+                             { Core::refresh(*this, nd); });
+    }
+
+    // the frozen array holds copies, so nodes stay free to share
+    void freeze() override
+    {
+        std::vector<T> vals;
+        vals.reserve(count);
+        inorderWalk(root, [&](Node *n)
+                    { vals.push_back(n->data); });
+        eytz.resize(vals.size());
+        size_t i = 0;
+        eytzingerInorder(vals.size(), [&](size_t k)
+                         { eytz[k] = std::move(vals[i++]); });
+        frozen = true;
+    }
+    bool isFrozen() const { return frozen; }
+
+    std::string toStringInorder() const override
+    {
+        std::ostringstream os;
+        if (frozen)
+            eytzingerInorder(eytz.size(), [&](size_t k)
+                             { printValue(&eytz[k], os); });
+        else
+            inorderWalk(root, [&](Node *n)
+                        { printValue(&n->data, os); });
+        return trimmed(os);
+    }
+    std::string toStringPreorder() const override
+    {
+        std::ostringstream os;
+        preorderWalk(root, [&](Node *n)
+                     { printValue(&n->data, os); });
+        return trimmed(os);
+    }
+    std::string toStringPostorder() const override
+    {
+        std::ostringstream os;
+        postorderWalk(root, [&](Node *n)
+                      { printValue(&n->data, os); });
+        return trimmed(os);
+    }
+    std::string toStringFormatted() const override
+    {
+        std::ostringstream os;
+        formattedWalk(root, os, [&](Node *n)
+                      { type->print(&n->data, os); });
+        return os.str();
+    }
+
+    bool fromStringTraversal(const std::string &str, const std::string &order) override
+    {
+        Core::loadTraversal(*this, str, order);
+        return true;
+    }
+    bool fromFormattedString(const std::string &str) override
+    {
+        Core::loadFormatted(*this, str);
+        return true;
+    }
+
+    std::vector<std::pair<void *, void *>> toPairList() const override { return Core::pairList(*this); }
+    std::vector<void *> toPreorderList() const override { return Core::preorderList(*this); }
+    bool fromPairList(const std::vector<std::pair<void *, void *>> &list) override { return Core::loadPairs(*this, list, false); }
+    bool fromPairListOwned(const std::vector<std::pair<void *, void *>> &list) override { return Core::loadPairs(*this, list, true); }
+    // copies of n values in the preorder of some search tree, in that shape
+    void fromPreorder(void *const *values, size_t n) override { Core::loadCopies(*this, values, n, "PRE"); }
+
+    void *searchByPathRaw(const std::string &path) const override { return Core::nodeAt(*this, path); }
+
+    void printTree(std::ostream &os = std::cout) const override
+    {
+        printLevels(root, os, [&](Node *n)
+                    { type->print(&n->data, os); });
+    }
+
+    void enableOrderStatistics() override { Core::enableOrderStatistics(*this); }
+    size_t rank(void *key) const override { return Core::countBelow(*this, probe(*static_cast<T *>(key)), false); }
+    void *select(size_t k) const override { return Core::select(*this, k); }
+    size_t countRange(void *lo, void *hi) const override
+    {
+        return Core::countRange(*this, probe(*static_cast<T *>(lo)), probe(*static_cast<T *>(hi)));
+    }
+    size_t rangeRaw(void *lo, void *hi, const std::function<bool(void *)> &f) const override
+    {
+        return Core::range(*this, probe(*static_cast<T *>(lo)), probe(*static_cast<T *>(hi)), f);
+    }
+
+    void unionWith(const TreeEngine &other) override { setOp(Core::SetOp::Union, other); }
+    void intersectWith(const TreeEngine &other) override { setOp(Core::SetOp::Intersect, other); }
+    void differenceWith(const TreeEngine &other) override { setOp(Core::SetOp::Difference, other); }
+    bool containsSubtree(const TreeEngine &sub) const override
+    {
+        std::unique_ptr<TypedBinaryTree> hold;
+        return Core::containsSubtree(*this, Core::sameEngine(*this, sub, hold));
+    }
+    TypedBinaryTree *subtree(void *key, bool share = false) const override
+    {
+        return Core::subtree(*this, probe(*static_cast<T *>(key)), share);
+    }
+    TypedBinaryTree *clone(bool share = false) const { return share ? sharedCopy(root, count) : Core::copy(*this, root); }
+    TypedBinaryTree *snapshot() const override { return clone(true); }
+
+    BalancePolicy policy() const override { return pol; }
+
+    // the same counters and figures as BinaryTree's; compares are comparator calls
+    const TreeStats &stats() const { return counters; }
+    void resetStats() override { counters.reset(); }
+    std::vector<size_t> depthHistogram() const override { return nodesPerDepth(root); }
+    size_t memoryEstimate() const override { return count * pool->blockSize() + eytz.capacity() * sizeof(T); }
+    std::string statsJson() const override
+    {
+        return counters.json(count, depthHistogram(), memoryEstimate(), pool->reserved() + eytz.capacity() * sizeof(T));
+    }
+
+private:
+    friend struct TreeCore<TypedBinaryTree>;
+    using Core = TreeCore<TypedBinaryTree>;
+
+    Type *type;
+    Node *root;
+    size_t count;
+    BalancePolicy pol;
+    bool sized;
+    Compare cmp;
+    std::shared_ptr<SlabPool> pool;
+    bool frozen;
+    std::vector<T> eytz;
+    std::mutex poolMutex; // the pool while a set operation forks
+    bool forking;
+    TreeStats counters;
+
+    // a value with its ordering key, taken once per descent
+    struct Probe
+    {
+        const T &value;
+        Key key;
+    };
+    static Probe probe(const T &v)
+    {
+        if constexpr (keyed)
+            return {v, Compare::key(v)};
+        else
+            return {v, {}};
+    }
+    static Probe probe(const Node *n)
+    {
+        if constexpr (keyed)
+            return {n->data, n->key};
+        else
+            return {n->data, {}};
+    }
+    // settles on the cached keys unless they tie on an inexact key
+    int compare(const Probe &k, const Node *n) const
+    {
+        if constexpr (keyed)
+        {
+            if (k.key != n->key)
+                return k.key < n->key ? -1 : +1;
+            if constexpr (Compare::exactKey)
+                return 0;
+        }
+        counters.add(TreeStats::Compares);
+        return cmp(k.value, n->data);
+    }
+    static void *value(const Node *n) { return const_cast<T *>(&n->data); }
+
+    bool sharing() const { return pool.use_count() > 1; }
+    std::unique_lock<std::mutex> poolLock()
+    {
+        if (!forking)
+            return std::unique_lock<std::mutex>();
+        return std::unique_lock<std::mutex>(poolMutex);
+    }
+    // nd itself, or a copy for the caller when other links to it remain
+    Node *own(Node *nd)
+    {
+        if (nd->refs == 1)
+            return nd;
+        Node *c = newNode(nd->data);
+        c->left = nd->left;
+        c->right = nd->right;
+        c->size = nd->size;
+        c->hash = nd->hash;
+        c->height = nd->height;
+        for (Node *ch : {nd->left, nd->right})
+            if (ch)
+                ++ch->refs;
+        --nd->refs;
+        return c;
+    }
+    // nd is unlinked and its children are linked elsewhere by the caller
+    void release(Node *nd)
+    {
+        if (nd->refs == 1)
+            return freeNode(nd);
+        for (Node *ch : {nd->left, nd->right})
+            if (ch)
+                ++ch->refs;
+        --nd->refs;
+    }
+    // dst is owned; src is about to be released
+    void takeValue(Node *dst, Node *src)
+    {
+        if (src->refs > 1)
+            dst->data = src->data;
+        else
+            dst->data = std::move(src->data);
+        dst->cacheKey();
+    }
+    TypedBinaryTree *blank() const { return new TypedBinaryTree(type, pol); }
+    TypedBinaryTree *sharedCopy(Node *nd, size_t n) const
+    {
+        TypedBinaryTree *out = blank();
+        out->pool = pool;
+        out->sized = sized;
+        out->root = nd;
+        out->count = n;
+        if (nd)
+            ++nd->refs;
+        return out;
+    }
+    void setOp(typename Core::SetOp op, const TreeEngine &other)
+    {
+        std::unique_ptr<TypedBinaryTree> hold;
+        Core::setOp(*this, op, Core::sameEngine(*this, other, hold));
+    }
+
+    void destroyAll(Node *nd)
+    {
+        std::vector<Node *> st;
+        if (nd)
+            st.push_back(nd);
+        while (!st.empty())
+        {
+            Node *n = st.back();
+            st.pop_back();
+            if (n->left)
+                st.push_back(n->left);
+            if (n->right)
+                st.push_back(n->right);
+            n->~Node();
+            counters.add(TreeStats::Destroys);
+        }
+    }
+    // a node holding a copy of d, or d itself when moved in
+    template <class V>
+    Node *newNode(V &&d)
+    {
+        counters.add(TreeStats::NodeAllocs);
+        counters.add(TreeStats::Clones);
+        void *mem;
+        {
+            auto lk = poolLock();
+            mem = pool->alloc();
+        }
+        return new (mem) Node(std::forward<V>(d));
+    }
+    Node *rawCopy(void *d) { return newNode(*static_cast<const T *>(d)); }
+    void freeNode(Node *nd)
+    {
+        nd->~Node();
+        counters.add(TreeStats::Destroys);
+        counters.add(TreeStats::NodeFrees);
+        auto lk = poolLock();
+        pool->free(nd);
+    }
+    void link(PathStack<Node> &path, Node *nd) { root = Core::relinkPath(*this, path, nd); }
+    // links a node built from d, or frees it when the value is already there
+    bool insertMoved(T &&d)
+    {
+        TreeStats::Timer tm(counters, TreeStats::Insert);
+        Node *n = newNode(std::move(d));
+        Probe k = probe(n);
+        if (sharing())
+            Core::unsharePath(*this, k);
+        if (!Core::insert(*this, k, [n]
+                          { return n; }))
+        {
+            freeNode(n);
+            return false;
+        }
+        thaw();
+        return true;
+    }
+    void thaw()
+    {
+        frozen = false;
+        std::vector<T>().swap(eytz);
+    }
+    bool searchFrozen(const T &key) const
+    {
+        size_t n = eytz.size(), k = 0;
+        while (k < n)
+        {
+#if defined(__GNUC__)
+            __builtin_prefetch(eytz.data() + std::min(16 * k + 15, n - 1));
+#endif
+            counters.add(TreeStats::Compares);
+            int c = cmp(key, eytz[k]);
+            if (c == 0)
+                return true;
+            k = 2 * k + 1 + (c > 0);
+        }
+        return false;
+    }
+    Node *parsedNode(std::string_view tok)
+    {
+        ParsedValue v(*type, tok);
+        return newNode(std::move(*static_cast<T *>(v.get())));
+    }
+
+    static std::string trimmed(const std::ostringstream &os)
+    {
+        std::string s = os.str();
+        if (!s.empty())
+            s.pop_back();
+        return s;
+    }
+    void printValue(const T *v, std::ostringstream &os) const
+    {
+        type->print(const_cast<T *>(v), os);
+        os << ' ';
+    }
+};
+
+// Type -> typed engine mapping; types without a specialization stay on BinaryTree
+template <class TypeT>
+struct TypedEngine
+{
+    using tree = void;
+};
+template <>
+struct TypedEngine<IntType>
+{
+    using tree = TypedBinaryTree<int>;
+};
+template <>
+struct TypedEngine<DoubleType>
+{
+    using tree = TypedBinaryTree<double, DoubleCompare>;
+};
+template <>
+struct TypedEngine<ComplexType>
+{
+    using tree = TypedBinaryTree<Complex, ComplexCompare>;
+};
+template <>
+struct TypedEngine<StringType>
+{
+    using tree = TypedBinaryTree<std::string, StringCompare>;
+};
+
+template <class TypeT>
+TreeEngine *makeTypedEngineAs(Type *t, BalancePolicy p)
+{
+    if (dynamic_cast<TypeT *>(t))
+        return new typename TypedEngine<TypeT>::tree(t, p);
+    return nullptr;
+}
+
+// returns nullptr when t has no typed engine; splay trees stay on BinaryTree
+inline TreeEngine *makeTypedEngine(Type *t, BalancePolicy p)
+{
+    if (p == BalancePolicy::Splay)
+        return nullptr;
+    TreeEngine *e = makeTypedEngineAs<IntType>(t, p);
+    if (!e)
+        e = makeTypedEngineAs<DoubleType>(t, p);
+    if (!e)
+        e = makeTypedEngineAs<ComplexType>(t, p);
+    if (!e)
+        e = makeTypedEngineAs<StringType>(t, p);
+    return e;
+}
@@ -8,12 +8,74 @@
 #include <cstdint>
 #include <algorithm>
 #include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <string_view>
+#include <new>
+#include <functional>
 
 // базовые функции
 inline int inc1(int x) { return x + 1; }
 inline int inc2(int x) { return x + 2; }
 inline int inc3(int x) { return x + 3; }
 
+// NUL-terminated copy of s for the strto* family, on the stack when it fits
+class CString
+{
+public:
+    explicit CString(std::string_view s)
+    {
+        if (s.size() < sizeof small)
+        {
+            std::memcpy(small, s.data(), s.size());
+            small[s.size()] = '\0';
+            p = small;
+        }
+        else
+        {
+            big.assign(s);
+            p = big.c_str();
+        }
+    }
+    CString(const CString &) = delete;
+    CString &operator=(const CString &) = delete;
+    const char *c_str() const { return p; }
+
+private:
+    char small[64];
+    std::string big;
+    const char *p;
+};
+
+// std::stoi and std::stod without the std::string argument
+inline int parseInt(std::string_view s)
+{
+    CString c(s);
+    char *end;
+    errno = 0;
+    long v = std::strtol(c.c_str(), &end, 10);
+    if (end == c.c_str())
+        throw std::invalid_argument("stoi");
+    if (errno == ERANGE || v < INT_MIN || v > INT_MAX)
+        throw std::out_of_range("stoi");
+    return static_cast<int>(v);
+}
+inline double parseDouble(std::string_view s)
+{
+    CString c(s);
+    char *end;
+    errno = 0;
+    double v = std::strtod(c.c_str(), &end);
+    if (end == c.c_str())
+        throw std::invalid_argument("stod");
+    if (errno == ERANGE)
+        throw std::out_of_range("stod");
+    return v;
+}
+
 class Type
 {
 public:
@@ -25,23 +87,85 @@ public:
     virtual void *createFromString(const std::string &s) const = 0;
     virtual void destroy(void *p) const = 0;
 
+    // in-place variants for values living in caller-owned storage of size() bytes
+    virtual void parseTo(void *dst, std::string_view s) const = 0; // throws like createFromString
+    virtual void copyTo(void *dst, void *src) const = 0;
+    virtual void moveTo(void *dst, void *src) const = 0; // src stays destroyable
+    virtual void destruct(void *p) const = 0;
+    virtual bool trivial() const = 0; // bitwise copyable, destruct() is a no-op
+
     virtual int compare(void *a, void *b) const = 0;
+    // Optional cached ordering key: keyWords() unsigned 64-bit words that
+    // order like the values wherever two keys differ, compared word by word.
+    // With exactKey() equal keys mean equal values; otherwise (a string
+    // prefix) they decide nothing and compare() breaks the tie. Trees compute
+    // it once per node and compare keys without calling into the Type.
+    static constexpr int maxKeyWords = 3;
+    virtual int keyWords() const { return 0; }
+    virtual bool exactKey() const { return false; }
+    virtual void key(void *, std::uint64_t *) const {}
+    virtual std::size_t hash(void *p) const = 0; // equal under compare => equal hash
     virtual void print(void *a, std::ostream &os) const = 0;
 };
 
+// Order-preserving map of doubles onto unsigned words for Type::key. -0.0
+// folds into +0.0 as compare() has them equal; NaN sorts after everything.
+inline std::uint64_t orderedBits(double x)
+{
+    if (x != x)
+        return ~std::uint64_t(0);
+    if (x == 0)
+        x = 0.0;
+    std::uint64_t b;
+    std::memcpy(&b, &x, sizeof b);
+    return b >> 63 ? ~b : b | std::uint64_t(1) << 63;
+}
+
+// Three-way compare in the order orderedBits gives: every NaN after all
+// numbers and equal to any other NaN, so the cached key stays exact.
+inline int compareDoubles(double x, double y)
+{
+    if (x < y)
+        return -1;
+    if (y < x)
+        return +1;
+    return (x != x) - (y != y);
+}
+
+// First 8 bytes of s as a big-endian integer, zero padded. std::string
+// compares bytes as unsigned char, so differing prefixes order like the strings.
+inline std::uint64_t stringPrefix(const std::string &s)
+{
+    unsigned char b[8] = {};
+    std::memcpy(b, s.data(), std::min<std::size_t>(s.size(), 8));
+    std::uint64_t p = 0;
+    for (unsigned char c : b)
+        p = p << 8 | c;
+    return p;
+}
+
+// +0.0 and -0.0 compare equal, so they must hash alike
+inline std::size_t hashDouble(double x) { return x != x ? ~std::size_t(0) : std::hash<double>()(x == 0 ? 0.0 : x); }
+
 class IntType : public Type
 {
 public:
     std::size_t size() const override { return sizeof(int); }
     Type *cloneType() const override { return new IntType(*this); }
     void *clone(void *p) const override { return new int{*static_cast<int *>(p)}; }
-    void *createFromString(const std::string &s) const override { return new int{std::stoi(s)}; }
+    void *createFromString(const std::string &s) const override { return new int{parseInt(s)}; }
+    void parseTo(void *dst, std::string_view s) const override { new (dst) int{parseInt(s)}; }
     void destroy(void *p) const override { delete static_cast<int *>(p); }
+    void copyTo(void *dst, void *src) const override { new (dst) int{*static_cast<int *>(src)}; }
+    void moveTo(void *dst, void *src) const override { copyTo(dst, src); }
+    void destruct(void *) const override {}
+    bool trivial() const override { return true; }
     int compare(void *a, void *b) const override
     {
         int x = *static_cast<int *>(a), y = *static_cast<int *>(b);
         return x < y ? -1 : (x > y ? +1 : 0);
     }
+    std::size_t hash(void *p) const override { return std::hash<int>()(*static_cast<int *>(p)); }
     void print(void *a, std::ostream &os) const override { os << *static_cast<int *>(a); }
 };
 
@@ -51,13 +175,21 @@ public:
     std::size_t size() const override { return sizeof(double); }
     Type *cloneType() const override { return new DoubleType(*this); }
     void *clone(void *p) const override { return new double{*static_cast<double *>(p)}; }
-    void *createFromString(const std::string &s) const override { return new double{std::stod(s)}; }
+    void *createFromString(const std::string &s) const override { return new double{parseDouble(s)}; }
+    void parseTo(void *dst, std::string_view s) const override { new (dst) double{parseDouble(s)}; }
     void destroy(void *p) const override { delete static_cast<double *>(p); }
+    void copyTo(void *dst, void *src) const override { new (dst) double{*static_cast<double *>(src)}; }
+    void moveTo(void *dst, void *src) const override { copyTo(dst, src); }
+    void destruct(void *) const override {}
+    bool trivial() const override { return true; }
     int compare(void *a, void *b) const override
     {
-        double x = *static_cast<double *>(a), y = *static_cast<double *>(b);
-        return x < y ? -1 : (x > y ? +1 : 0);
+        return compareDoubles(*static_cast<double *>(a), *static_cast<double *>(b));
     }
+    int keyWords() const override { return 1; }
+    bool exactKey() const override { return true; }
+    void key(void *p, std::uint64_t *k) const override { k[0] = orderedBits(*static_cast<double *>(p)); }
+    std::size_t hash(void *p) const override { return hashDouble(*static_cast<double *>(p)); }
     void print(void *a, std::ostream &os) const override { os << *static_cast<double *>(a); }
 };
 
@@ -68,43 +200,70 @@ public:
     std::size_t size() const override { return sizeof(Complex); }
     Type *cloneType() const override { return new ComplexType(*this); }
     void *clone(void *p) const override { return new Complex{*static_cast<Complex *>(p)}; }
-    void *createFromString(const std::string &s) const override
-    {
-        std::string t = s;
-        t.erase(std::remove_if(t.begin(), t.end(), ::isspace), t.end());
-        if (t.empty())
-            throw std::invalid_argument("bad complex");
-        if (t.back() != 'i')
-            return new Complex{std::stod(t), 0.};
-        t.pop_back();
-        size_t pos = t.find_last_of("+-", t.size() - 1);
-        if (pos == std::string::npos || pos == 0)
-        {
-            double im = std::stod(t);
-            return new Complex{0., im};
-        }
-        double re = std::stod(t.substr(0, pos));
-        double im = std::stod(t.substr(pos));
-        return new Complex{re, im};
-    }
+    void *createFromString(const std::string &s) const override { return new Complex{parse(s)}; }
+    void parseTo(void *dst, std::string_view s) const override { new (dst) Complex{parse(s)}; }
     void destroy(void *p) const override { delete static_cast<Complex *>(p); }
+    void copyTo(void *dst, void *src) const override { new (dst) Complex{*static_cast<Complex *>(src)}; }
+    void moveTo(void *dst, void *src) const override { copyTo(dst, src); }
+    void destruct(void *) const override {}
+    bool trivial() const override { return true; }
     int compare(void *a, void *b) const override
     {
         auto &A = *static_cast<Complex *>(a), &B = *static_cast<Complex *>(b);
-        double na = std::norm(A), nb = std::norm(B);
-        if (na != nb)
-            return na < nb ? -1 : +1;
-        if (A.real() != B.real())
-            return A.real() < B.real() ? -1 : +1;
-        if (A.imag() != B.imag())
-            return A.imag() < B.imag() ? -1 : +1;
-        return 0;
+        if (int c = compareDoubles(std::norm(A), std::norm(B)))
+            return c;
+        if (int c = compareDoubles(A.real(), B.real()))
+            return c;
+        return compareDoubles(A.imag(), B.imag());
+    }
+    // (norm, real, imag), the order compare() goes by
+    int keyWords() const override { return 3; }
+    bool exactKey() const override { return true; }
+    void key(void *p, std::uint64_t *k) const override
+    {
+        auto &z = *static_cast<Complex *>(p);
+        k[0] = orderedBits(std::norm(z));
+        k[1] = orderedBits(z.real());
+        k[2] = orderedBits(z.imag());
+    }
+    std::size_t hash(void *p) const override
+    {
+        auto &z = *static_cast<Complex *>(p);
+        return hashDouble(z.real()) * 31 + hashDouble(z.imag());
     }
     void print(void *a, std::ostream &os) const override
     {
         auto &z = *static_cast<Complex *>(a);
         os << z.real() << (z.imag() >= 0 ? "+" : "") << z.imag() << "i";
     }
+
+private:
+    // "a", "bi" or "a+bi", spaces anywhere
+    static Complex parse(std::string_view s)
+    {
+        char small[64];
+        std::string big;
+        char *buf = small;
+        if (s.size() > sizeof small)
+        {
+            big.resize(s.size());
+            buf = &big[0];
+        }
+        size_t n = 0;
+        for (char c : s)
+            if (!std::isspace(static_cast<unsigned char>(c)))
+                buf[n++] = c;
+        std::string_view t(buf, n);
+        if (t.empty())
+            throw std::invalid_argument("bad complex");
+        if (t.back() != 'i')
+            return {parseDouble(t), 0.};
+        t.remove_suffix(1);
+        size_t pos = t.find_last_of("+-", t.size() - 1);
+        if (pos == std::string_view::npos || pos == 0)
+            return {0., parseDouble(t)};
+        return {parseDouble(t.substr(0, pos)), parseDouble(t.substr(pos))};
+    }
 };
 
 class StringType : public Type
@@ -114,12 +273,20 @@ public:
     Type *cloneType() const override { return new StringType(*this); }
     void *clone(void *p) const override { return new std::string{*static_cast<std::string *>(p)}; }
     void *createFromString(const std::string &s) const override { return new std::string{s}; }
+    void parseTo(void *dst, std::string_view s) const override { new (dst) std::string{s}; }
     void destroy(void *p) const override { delete static_cast<std::string *>(p); }
+    void copyTo(void *dst, void *src) const override { new (dst) std::string{*static_cast<std::string *>(src)}; }
+    void moveTo(void *dst, void *src) const override { new (dst) std::string{std::move(*static_cast<std::string *>(src))}; }
+    void destruct(void *p) const override { static_cast<std::string *>(p)->~basic_string(); }
+    bool trivial() const override { return false; }
     int compare(void *a, void *b) const override
     {
         auto &A = *static_cast<std::string *>(a), &B = *static_cast<std::string *>(b);
         return A < B ? -1 : (A > B ? +1 : 0); // dictionary order comparation
     }
+    int keyWords() const override { return 1; }
+    void key(void *p, std::uint64_t *k) const override { k[0] = stringPrefix(*static_cast<std::string *>(p)); }
+    std::size_t hash(void *p) const override { return std::hash<std::string>()(*static_cast<std::string *>(p)); }
     void print(void *a, std::ostream &os) const override { os << *static_cast<std::string *>(a); }
 };
 
@@ -130,27 +297,39 @@ public:
     std::size_t size() const override { return sizeof(FunctionPtr); }
     Type *cloneType() const override { return new FunctionType(*this); }
     void *clone(void *p) const override { return new FunctionPtr{*static_cast<FunctionPtr *>(p)}; }
-    void *createFromString(const std::string &s) const override
-    {
-        if (s == "inc1")
-            return new FunctionPtr{inc1};
-        if (s == "inc2")
-            return new FunctionPtr{inc2};
-        if (s == "inc3")
-            return new FunctionPtr{inc3};
-        throw std::invalid_argument("bad func");
-    }
+    void *createFromString(const std::string &s) const override { return new FunctionPtr{parse(s)}; }
+    void parseTo(void *dst, std::string_view s) const override { new (dst) FunctionPtr{parse(s)}; }
     void destroy(void *p) const override { delete static_cast<FunctionPtr *>(p); }
+    void copyTo(void *dst, void *src) const override { new (dst) FunctionPtr{*static_cast<FunctionPtr *>(src)}; }
+    void moveTo(void *dst, void *src) const override { copyTo(dst, src); }
+    void destruct(void *) const override {}
+    bool trivial() const override { return true; }
     int compare(void *a, void *b) const override
     {
         auto pa = reinterpret_cast<std::uintptr_t>(*static_cast<FunctionPtr *>(a));
         auto pb = reinterpret_cast<std::uintptr_t>(*static_cast<FunctionPtr *>(b));
         return pa < pb ? -1 : (pa > pb ? +1 : 0); // memory address comparation
     }
+    int keyWords() const override { return 1; }
+    bool exactKey() const override { return true; }
+    void key(void *p, std::uint64_t *k) const override { k[0] = reinterpret_cast<std::uintptr_t>(*static_cast<FunctionPtr *>(p)); }
+    std::size_t hash(void *p) const override { return std::hash<std::uintptr_t>()(reinterpret_cast<std::uintptr_t>(*static_cast<FunctionPtr *>(p))); }
     void print(void *a, std::ostream &os) const override
     {
         os << "Func@" << std::hex << reinterpret_cast<std::uintptr_t>(*static_cast<FunctionPtr *>(a)) << std::dec;
     }
+
+private:
+    static FunctionPtr parse(std::string_view s)
+    {
+        if (s == "inc1")
+            return inc1;
+        if (s == "inc2")
+            return inc2;
+        if (s == "inc3")
+            return inc3;
+        throw std::invalid_argument("bad func");
+    }
 };
 
 class PersonType : public Type
@@ -160,11 +339,57 @@ public:
     Type *cloneType() const override { return new PersonType(*this); }
     void *clone(void *p) const override { return new std::string{*static_cast<std::string *>(p)}; }
     void *createFromString(const std::string &s) const override { return new std::string{s}; }
+    void parseTo(void *dst, std::string_view s) const override { new (dst) std::string{s}; }
     void destroy(void *p) const override { delete static_cast<std::string *>(p); }
+    void copyTo(void *dst, void *src) const override { new (dst) std::string{*static_cast<std::string *>(src)}; }
+    void moveTo(void *dst, void *src) const override { new (dst) std::string{std::move(*static_cast<std::string *>(src))}; }
+    void destruct(void *p) const override { static_cast<std::string *>(p)->~basic_string(); }
+    bool trivial() const override { return false; }
     int compare(void *a, void *b) const override
     {
         auto &A = *static_cast<std::string *>(a), &B = *static_cast<std::string *>(b);
         return A < B ? -1 : (A > B ? +1 : 0);
     }
+    int keyWords() const override { return 1; }
+    void key(void *p, std::uint64_t *k) const override { k[0] = stringPrefix(*static_cast<std::string *>(p)); }
+    std::size_t hash(void *p) const override { return std::hash<std::string>()(*static_cast<std::string *>(p)); }
     void print(void *a, std::ostream &os) const override { os << *static_cast<std::string *>(a); }
 };
+
+// A temporary value parsed into inline storage, such as a lookup key: the
+// heap is touched only by values that need it themselves (long strings).
+class ParsedValue
+{
+public:
+    ParsedValue(const Type &t, std::string_view s) : t(t), p(t.size() <= sizeof buf ? buf : ::operator new(t.size()))
+    {
+        try
+        {
+            t.parseTo(p, s);
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+    }
+    ~ParsedValue()
+    {
+        t.destruct(p);
+        release();
+    }
+    ParsedValue(const ParsedValue &) = delete;
+    ParsedValue &operator=(const ParsedValue &) = delete;
+    void *get() const { return p; }
+
+private:
+    void release()
+    {
+        if (p != buf)
+            ::operator delete(p);
+    }
+
+    const Type &t;
+    alignas(std::max_align_t) unsigned char buf[32];
+    void *p;
+};
@@ -0,0 +1,436 @@
+#include "BinaryTree.h"
+#include "ShardedTree.h"
+#include "TypedBinaryTree.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Every allocation in the process comes through here (slabs included), so
+// the tables can show allocations per operation.
+static std::atomic<long long> allocations(0);
+
+static void *countedAlloc(std::size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// the scalar and array forms are replaced as a set, so every delete frees
+// what a matching new of ours got from malloc
+void *operator new(std::size_t n) { return countedAlloc(n); }
+void *operator new[](std::size_t n) { return countedAlloc(n); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    double seconds(Clock::time_point a, Clock::time_point b)
+    {
+        return std::chrono::duration<double>(b - a).count();
+    }
+
+    // peak resident set in MiB; on Linux resetPeakRss() starts a new peak,
+    // elsewhere the figure is the peak of the whole run so far
+    double peakRss()
+    {
+#ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS pmc;
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+            return 0;
+        return pmc.PeakWorkingSetSize / 1048576.0;
+#else
+        std::ifstream status("/proc/self/status");
+        std::string key;
+        long kb;
+        while (status >> key)
+            if (key == "VmHWM:" && status >> kb)
+                return kb / 1024.0;
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_maxrss / 1024.0;
+#endif
+    }
+
+    void resetPeakRss()
+    {
+#ifdef __linux__
+        std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+    }
+
+    struct Case
+    {
+        const char *name;
+        Type *type;
+        std::string (*text)(size_t i); // key i, ordered like i
+    };
+
+    std::string intText(size_t i) { return std::to_string(i); }
+    std::string doubleText(size_t i) { return std::to_string(i) + ".5"; }
+    std::string complexText(size_t i) { return std::to_string(i) + "+1i"; }
+    std::string stringText(size_t i)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "k%010zu", i);
+        return buf;
+    }
+    // people share long prefixes, which is what makes them slow to compare
+    std::string personText(size_t i)
+    {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "Ivanova Anna Sergeevna %010zu", i);
+        return buf;
+    }
+
+    enum class Dist
+    {
+        Sorted,
+        Random,
+        Zipf
+    };
+    const char *distName(Dist d) { return d == Dist::Sorted ? "sorted" : d == Dist::Random ? "random" : "zipf"; }
+
+    // indices of the keys in the order the operations touch them; Zipf draws
+    // repeat (exponent s) and its hot keys are scattered over the key range
+    std::vector<size_t> sequence(Dist d, size_t n, std::mt19937_64 &rng, double s = 0.99)
+    {
+        std::vector<size_t> seq(n);
+        std::iota(seq.begin(), seq.end(), size_t(0));
+        if (d == Dist::Sorted)
+            return seq;
+        std::shuffle(seq.begin(), seq.end(), rng);
+        if (d == Dist::Random)
+            return seq;
+        std::vector<double> cdf(n);
+        double sum = 0;
+        for (size_t k = 0; k < n; ++k)
+            cdf[k] = sum += 1.0 / std::pow(double(k + 1), s);
+        std::uniform_real_distribution<double> u(0, sum);
+        std::vector<size_t> draws(n);
+        for (size_t &x : draws)
+        {
+            size_t rank = std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin();
+            x = seq[std::min(rank, n - 1)];
+        }
+        return draws;
+    }
+
+    size_t countNodes(const TreeEngine &t)
+    {
+        return t.toPreorderList().size();
+    }
+
+    // the operations table runs every case on both engines; the typed one
+    // is nullptr for the types it has no template for
+    const char *const engines[] = {"BinaryTree", "Typed"};
+
+    TreeEngine *makeEngine(int engine, Type *type, BalancePolicy p)
+    {
+        if (engine == 0)
+            return new BinaryTree(type, p);
+        return makeTypedEngine(type, p);
+    }
+
+    size_t sink; // keeps serializer results observable
+
+    // one table row: ns and allocations per op, where whole-tree operations
+    // count one op per element they process
+    struct Row
+    {
+        const char *type;
+        const char *engine;
+        const char *dist;
+        size_t n;
+
+        template <class F>
+        void measure(const char *op, size_t ops, F f) const
+        {
+            long long a0 = allocations.load();
+            Clock::time_point t0 = Clock::now();
+            f();
+            Clock::time_point t1 = Clock::now();
+            long long a = allocations.load() - a0;
+            ops = std::max<size_t>(ops, 1);
+            std::printf("%-8s %-10s %-7s %9zu %-10s %9zu %12.1f %10.2f %9.1f\n", type, engine, dist, n, op, ops,
+                        seconds(t0, t1) * 1e9 / ops, double(a) / ops, peakRss());
+            std::fflush(stdout);
+        }
+    };
+
+    // AVL trees throughout: sorted input would degenerate an unbalanced tree
+    void operations(const Case &c, int engine, Dist d, size_t n)
+    {
+        Type *type = c.type;
+        std::unique_ptr<TreeEngine> tree(makeEngine(engine, type, BalancePolicy::AVL));
+        if (!tree)
+            return;
+        resetPeakRss();
+        std::mt19937_64 rng(n * 31 + static_cast<int>(d));
+        std::vector<void *> vals(n + n / 2);
+        for (size_t i = 0; i < vals.size(); ++i)
+            vals[i] = type->createFromString(c.text(i));
+        std::vector<size_t> seq = sequence(d, n, rng);
+        Row row{c.name, engines[engine], distName(d), n};
+
+        row.measure("insert", seq.size(), [&]
+                    {
+            for (size_t i : seq)
+                tree->insertRaw(vals[i]); });
+        size_t size = countNodes(*tree);
+        row.measure("search", seq.size(), [&]
+                    {
+            size_t hits = 0;
+            for (size_t i : seq)
+                hits += tree->searchRaw(vals[i]);
+            sink += hits; });
+
+        row.measure("toStrIn", size, [&]
+                    { sink += tree->toStringInorder().size(); });
+        row.measure("toStrPre", size, [&]
+                    { sink += tree->toStringPreorder().size(); });
+        row.measure("toStrPost", size, [&]
+                    { sink += tree->toStringPostorder().size(); });
+        row.measure("toStrForm", size, [&]
+                    { sink += tree->toStringFormatted().size(); });
+
+        // half of the other tree's keys are already present
+        std::unique_ptr<TreeEngine> other(makeEngine(engine, type, BalancePolicy::AVL));
+        std::vector<size_t> upper(n);
+        std::iota(upper.begin(), upper.end(), n / 2);
+        std::shuffle(upper.begin(), upper.end(), rng);
+        for (size_t i : upper)
+            other->insertRaw(vals[i]);
+        std::unique_ptr<TreeEngine> merged(makeEngine(engine, type, BalancePolicy::AVL));
+        std::vector<void *> pre = tree->toPreorderList();
+        merged->fromPreorder(pre.data(), pre.size());
+        row.measure("merge", n, [&]
+                    { merged->unionWith(*other); });
+        merged.reset();
+
+        // the root's left child: about half the tree
+        void *key = tree->searchByPathRaw("L");
+        if (!key)
+            key = tree->searchByPathRaw("");
+        TreeEngine *sub = tree->subtree(key);
+        size_t subSize = countNodes(*sub);
+        delete sub;
+        row.measure("subtree", subSize, [&]
+                    { sub = tree->subtree(key); });
+        row.measure("contains", subSize, [&]
+                    { sink += tree->containsSubtree(*sub); });
+        delete sub;
+
+        row.measure("balance", size, [&]
+                    { tree->balance(); });
+        row.measure("remove", seq.size(), [&]
+                    {
+            for (size_t i : seq)
+                tree->removeRaw(vals[i]); });
+
+        for (void *v : vals)
+            type->destroy(v);
+    }
+
+    // Readers look up even keys, which are always present, while one writer
+    // inserts and removes odd keys and rebalances now and then. A reader that
+    // misses an even key means a torn or reclaimed snapshot.
+    bool concurrentReads(int readers, int keys, double runFor)
+    {
+        IntType type;
+        BinaryTree tree(&type, BalancePolicy::AVL, Concurrency::LockFreeReads);
+        for (int v = 0; v < 2 * keys; v += 2)
+            tree.insertRaw(&v);
+
+        std::atomic<bool> stop(false);
+        std::atomic<long long> reads(0), misses(0);
+        std::vector<std::thread> pool;
+        for (int r = 0; r < readers; ++r)
+            pool.emplace_back([&, r]
+                              {
+                std::mt19937 rng(r + 1);
+                long long n = 0, bad = 0;
+                while (!stop.load(std::memory_order_relaxed))
+                {
+                    int k = static_cast<int>(rng() % keys) * 2;
+                    bad += !tree.searchRaw(&k);
+                    ++n;
+                }
+                reads += n;
+                misses += bad; });
+
+        std::mt19937 rng(12345);
+        long long writes = 0;
+        Clock::time_point start = Clock::now();
+        while (seconds(start, Clock::now()) < runFor)
+        {
+            int k = static_cast<int>(rng() % keys) * 2 + 1;
+            if (rng() & 1)
+                tree.insertRaw(&k);
+            else
+                tree.removeRaw(&k);
+            if (++writes % 10000 == 0)
+                tree.balance();
+        }
+        stop = true;
+        for (std::thread &t : pool)
+            t.join();
+        double dt = seconds(start, Clock::now());
+
+        std::printf("%7d %9d %14.0f %14.0f %8lld\n", readers, keys,
+                    reads / dt, writes / dt, misses.load());
+        return misses == 0;
+    }
+
+    // Both trees hold keys 0..n-1 inserted in random order; then n lookups
+    // drawn from d, Zipf with exponent s. The second pass is timed, once the
+    // Splay tree has adapted to the draws and the caches are warm.
+    void splayLookups(const Case &c, Dist d, double s, size_t n)
+    {
+        std::mt19937_64 rng(n * 17 + static_cast<int>(d));
+        Type *type = c.type;
+        std::vector<void *> vals(n);
+        for (size_t i = 0; i < n; ++i)
+            vals[i] = type->createFromString(c.text(i));
+        std::vector<size_t> fill = sequence(Dist::Random, n, rng);
+        std::vector<size_t> seq = sequence(d, n, rng, s);
+        double ns[2];
+        const BalancePolicy policies[] = {BalancePolicy::AVL, BalancePolicy::Splay};
+        for (int p = 0; p < 2; ++p)
+        {
+            BinaryTree tree(type, policies[p]);
+            for (size_t i : fill)
+                tree.insertRaw(vals[i]);
+            size_t hits = 0;
+            Clock::time_point t0;
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                t0 = Clock::now();
+                for (size_t i : seq)
+                    hits += tree.accessRaw(vals[i]);
+            }
+            ns[p] = seconds(t0, Clock::now()) * 1e9 / n;
+            sink += hits;
+        }
+        for (void *v : vals)
+            type->destroy(v);
+        char dist[16];
+        if (d == Dist::Zipf)
+            std::snprintf(dist, sizeof(dist), "zipf%.2g", s);
+        else
+            std::snprintf(dist, sizeof(dist), "%s", distName(d));
+        std::printf("%-8s %-8s %9zu %12.1f %12.1f %7.2fx\n", c.name, dist, n, ns[0], ns[1], ns[0] / ns[1]);
+        std::fflush(stdout);
+    }
+
+    // n random keys in batches of 64K into 64 adaptive shards; threads = 0 is
+    // the single BinaryTree baseline. Returns inserts per second.
+    double shardedInserts(unsigned threads, size_t n, double base)
+    {
+        IntType type;
+        std::mt19937 rng(7);
+        std::vector<int> keys(n);
+        for (int &k : keys)
+            k = static_cast<int>(rng());
+        const size_t batch = 1 << 16;
+        Clock::time_point start = Clock::now();
+        size_t added = 0;
+        if (threads == 0)
+        {
+            BinaryTree tree(&type, BalancePolicy::AVL);
+            for (int &k : keys)
+                added += tree.insertRaw(&k);
+        }
+        else
+        {
+            ShardedTree tree(&type, 64, threads);
+            for (size_t i = 0; i < n; i += batch)
+                added += tree.insertBatch(&keys[i], std::min(batch, n - i));
+        }
+        double rate = added / seconds(start, Clock::now());
+        if (threads == 0)
+            std::printf("%7s %9zu %14.0f %8s\n", "single", n, rate, "");
+        else
+            std::printf("%7u %9zu %14.0f %7.2fx\n", threads, n, rate, rate / base);
+        return rate;
+    }
+}
+
+// tree_bench [--max N]: sizes go 1K, 10K, ... up to N (default 1M; the full
+// 10M run needs several GB for the string types)
+int main(int argc, char **argv)
+{
+    size_t maxSize = 1000000;
+    for (int i = 1; i + 1 < argc; ++i)
+        if (std::strcmp(argv[i], "--max") == 0)
+            maxSize = std::strtoull(argv[i + 1], nullptr, 10);
+
+    IntType intType;
+    DoubleType doubleType;
+    ComplexType complexType;
+    StringType stringType;
+    PersonType personType;
+    const Case cases[] = {
+        {"INT", &intType, intText},
+        {"DOUBLE", &doubleType, doubleText},
+        {"COMPLEX", &complexType, complexText},
+        {"STRING", &stringType, stringText},
+        {"PERSON", &personType, personText},
+    };
+
+    std::printf("operations (AVL), peak RSS in MiB\n");
+    std::printf("%-8s %-10s %-7s %9s %-10s %9s %12s %10s %9s\n", "type", "engine", "keys", "n", "op", "ops",
+                "ns/op", "allocs/op", "peak RSS");
+    for (const Case &c : cases)
+        for (Dist d : {Dist::Sorted, Dist::Random, Dist::Zipf})
+            for (size_t n = 1000; n <= maxSize; n *= 10)
+                for (int engine = 0; engine < 2; ++engine)
+                    operations(c, engine, d, n);
+
+    bool ok = true;
+    std::printf("\nconcurrent reads (AVL, LockFreeReads, one writer), %u hardware threads\n",
+                std::thread::hardware_concurrency());
+    std::printf("%7s %9s %14s %14s %8s\n", "readers", "keys", "reads/s", "writes/s", "misses");
+    for (int readers : {1, 2, 4, 8})
+        ok &= concurrentReads(readers, 100000, 1.0);
+
+    std::printf("\nlookups, AVL vs Splay (keys inserted in random order)\n");
+    std::printf("%-8s %-8s %9s %12s %12s %8s\n", "type", "lookups", "n", "AVL ns/op", "Splay ns/op", "speedup");
+    const std::pair<Dist, double> skews[] = {{Dist::Random, 0}, {Dist::Zipf, 0.99}, {Dist::Zipf, 1.2}};
+    for (const Case &c : {cases[0], cases[3]})
+        for (auto [d, s] : skews)
+            for (size_t n = 10000; n <= maxSize; n *= 10)
+                splayLookups(c, d, s, n);
+
+    std::printf("\nsharded inserts (INT, AVL, 64 adaptive shards, batches of 64K), %u hardware threads\n",
+                std::thread::hardware_concurrency());
+    std::printf("%7s %9s %14s %8s\n", "threads", "keys", "inserts/s", "speedup");
+    double base = shardedInserts(0, maxSize, 0);
+    for (unsigned threads : {1, 2, 4, 8, 16, 32})
+        shardedInserts(threads, maxSize, base);
+    return ok ? 0 : 1;
+}
@@ -1,9 +1,13 @@
-
 #include "Menu.h"
+#include <string>
 
-int main()
+int main(int argc, char **argv)
 {
     MenuTree menu;
+    // tree_app --batch commands.txt replays a command file without
+    // per-line round trips through std::cin/std::cout
+    if (argc == 3 && std::string(argv[1]) == "--batch")
+        return menu.runBatch(argv[2]) ? 0 : 1;
     menu.run();
     return 0;
 }